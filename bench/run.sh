@@ -0,0 +1,127 @@
+#!/bin/sh
+# Times the benchmarks behind the numbers quoted in commit messages. Each is
+# a script fed to the REPL on stdin and is timed as the best wall time of
+# RUNS runs, 5 by default. Inputs too long to keep here, like lists with
+# thousands of elements, are generated.
+#
+# Usage: bench/run.sh [NAME...]
+#   Runs the named benchmarks, or all of them
+#   YALP picks the interpreter to time, for comparing with another build,
+#   otherwise this tree is built with CC and CFLAGS, -O2 by default
+
+here=$(cd "$(dirname "$0")" && pwd)
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+RUNS=${RUNS:-5}
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+if [ -z "$YALP" ]; then
+    YALP="$work/yalp"
+    $CC -std=gnu11 $CFLAGS -o "$YALP" "$here/../yalp.c" || exit 1
+fi
+
+# Whether the benchmark NAME was asked for
+selected()
+{
+    [ -z "$names" ] && return 0
+    for name in $names; do
+        [ "$name" = "$1" ] && return 0
+    done
+    return 1
+}
+
+# numbers FROM TO prints a list of the integers from FROM to TO
+numbers()
+{
+    echo "(list $(seq -s ' ' "$1" "$2"))"
+}
+
+# time_script NAME [ARGS...] runs NAME.lisp in the scratch directory with
+# ARGS and prints the best time
+time_script()
+{
+    name=$1
+    shift
+    best=
+    i=0
+    while [ "$i" -lt "$RUNS" ]; do
+        start=$(date +%s%N)
+        "$YALP" "$@" < "$work/$name.lisp" > /dev/null 2>&1
+        ms=$((($(date +%s%N) - start) / 1000000))
+        if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+            best=$ms
+        fi
+        i=$((i + 1))
+    done
+    printf '%-40s %6d ms\n' "$name $*" "$best"
+}
+
+names="$*"
+
+# 10 lists of 20000 elements, with garbage between them so that a full
+# collection leaves their spines scattered, walked 8 times with reduce and
+# printed 15 times. Compaction lays the spines out in order.
+if selected traversal; then
+    lists=
+    for i in 0 1 2 3 4 5 6 7 8 9; do
+        echo "(progn (define big$i $(numbers 1 20000)) 0)"
+        echo "(progn $(numbers 1 5000) 0)"
+        lists="$lists big$i"
+    done > "$work/lists.lisp"
+    {
+        cat "$work/lists.lisp"
+        echo "(defun walk (n) (if (< n 1) 0 (progn"
+        for list in $lists; do
+            echo "    (reduce + $list 0)"
+        done
+        echo "    (walk (- n 1)))))"
+        echo "(walk 8)"
+    } > "$work/traversal_reduce.lisp"
+    {
+        cat "$work/lists.lisp"
+        echo "(defun show (n) (if (< n 1) 0 (progn"
+        for list in $lists; do
+            echo "    (print $list)"
+        done
+        echo "    (show (- n 1)))))"
+        echo "(show 15)"
+    } > "$work/traversal_print.lisp"
+    time_script traversal_reduce
+    time_script traversal_reduce --compact
+    time_script traversal_print
+    time_script traversal_print --compact
+fi
+
+# fib 25 with no other globals and with 1000 of them, which used to slow
+# down every lookup that reached the global frame
+if selected globals; then
+    fib="(defun fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"
+    printf '%s\n(fib 25)\n' "$fib" > "$work/globals_0.lisp"
+    {
+        for i in $(seq 1 1000); do
+            echo "(define global$i $i)"
+        done
+        printf '%s\n(fib 25)\n' "$fib"
+    } > "$work/globals_1000.lisp"
+    time_script globals_0
+    time_script globals_1000
+fi
+
+# An outer reduce over a list of 1000 elements that runs an inner sequence
+# builtin over the same list at every step, a million calls in all
+if selected sequences; then
+    # sequence NAME INNER writes the benchmark running INNER at every step
+    sequence()
+    {
+        printf '(define numbers %s)\n(reduce (lambda (x s) %s) numbers 0)\n' \
+            "$(numbers 1 1000)" "$2" > "$work/sequences_$1.lisp"
+        time_script "sequences_$1"
+    }
+    sequence reduce_builtin "(reduce + numbers 0)"
+    sequence reduce_lambda "(reduce (lambda (y t) (+ y t)) numbers 0)"
+    sequence map "(map (lambda (y) (* y 2)) numbers)"
+    sequence filter "(filter (lambda (y) (< y 500)) numbers)"
+    sequence for_each "(for_each (lambda (y) y) numbers)"
+fi
@@ -0,0 +1,20 @@
+(defun build (n acc) (if (< n 1) acc (build (- n 1) (list n acc))))
+(defun churn (n) (if (< n 1) 0 (progn (build 50 ()) (churn (- n 1)))))
+(define old_vector (make_vector 4))
+(define old_hash (make_hash))
+(churn 100)
+(vector_set old_vector 0 (build 3 ()))
+(hash_set old_hash 'young (build 2 ()))
+(hash_set old_hash (build 2 ()) 'young_key)
+(churn 100)
+old_vector
+(hash_get old_hash 'young)
+(hash_get old_hash (list 1 (list 2 ())))
+(define old_list (build 5 ()))
+(churn 100)
+(define old_list (list (build 4 ()) old_list))
+(churn 200)
+old_list
+(defun keep (x) (progn (churn 50) x))
+(keep (build 6 ()))
+(vector_map (lambda (x) (build 2 ())) old_vector)
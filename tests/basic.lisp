@@ -0,0 +1,25 @@
+(+ 1 2)
+(- 10 3 2)
+(- 5)
+(* 2 3 4)
+(/ 100 5 2)
+(= 1 1 1)
+(< 1 2)
+(< 2 1)
+(defun fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))
+(fib 15)
+(reduce + (list 1 2 3) 0)
+(loop (i) (0) (if (< i 10) (recur (+ i 1)) i))
+(quote (a b c))
+'(1 2 (3 4))
+(define x 42)
+x
+(list x (+ x 1) 'y)
+(progn (print 1 2) (printl 3) 4)
+((lambda (a b) (* a b)) 6 7)
+(if false 1)
+(if true 1 2)
+undefined_sym
+()
+(defun sum (lst) (reduce + lst 0))
+(sum (list 1 2 3 4 5))
@@ -0,0 +1,15 @@
+(defun build (n acc) (if (< n 1) acc (build (- n 1) (list n acc))))
+(define keep (make_vector 50))
+(loop (i) (0) (if (< i 50) (progn (build 100 ()) (vector_set keep i (build 3 ())) (build 100 ()) (recur (+ i 1))) 0))
+(define h (make_hash))
+(loop (i) (0) (if (< i 300) (progn (build 20 ()) (hash_set h i (list i "s")) (recur (+ i 1))) 0))
+(loop (i) (0) (if (< i 300) (progn (hash_remove h i) (recur (+ i 3))) 0))
+(loop (i) (0) (if (< i 30) (progn (build 500 ()) (recur (+ i 1))) 0))
+(vector_ref keep 0)
+(vector_ref keep 49)
+(hash_count h)
+(hash_get h 298)
+(hash_get h 299)
+(reduce (lambda (x s) (+ s (vector_length (vector x)))) keep 0)
+(defun fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))
+(fib 15)
@@ -0,0 +1,49 @@
+// A host program using the embedding API. It defines functions named like
+// some of the interpreter's own, which only links while those stay out of
+// what yalp.c exports.
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../yalp.h"
+
+int next(int n)
+{
+    return n + 1;
+}
+
+int intern(int n)
+{
+    return n * 2;
+}
+
+static void run(struct yalp_isolate* isolate, const char* source)
+{
+    char* result;
+    bool ran = yalp_eval_string(isolate, source, &result);
+    printf("%s => %s%s\n", source, ran ? "" : "failed: ", result);
+    free(result);
+}
+
+int main(void)
+{
+    struct yalp_isolate* first = yalp_isolate_create();
+    struct yalp_isolate* second = yalp_isolate_create();
+
+    run(first, "(define x 5) (+ x 1)");
+    // Isolates don't share globals
+    run(second, "x");
+    run(second, "(define x (list 1 2)) x");
+    run(first, "x");
+    run(first, "(defun fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))) (fib 20)");
+    run(first, "(define y 1) (+ 1");
+    run(first, "y");
+    run(first, "(lambda)");
+    run(first, "((lambda x x) 1)");
+    run(first, "");
+
+    yalp_isolate_destroy(first);
+    yalp_isolate_destroy(second);
+
+    printf("%d %d\n", next(1), intern(2));
+    return 0;
+}
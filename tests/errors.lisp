@@ -0,0 +1,52 @@
+(+ 1 x)
+(foo 1 2)
+(1 2 3)
+(define y (+ 1 nothere))
+y
+(print 1 2 (list 3 4))
+(printl 1 zz 3)
+(- 5)
+(- 10 3 2)
+(/ 100 5 2)
+(/ 4)
+(*)
+(= 1 1 1)
+(< 1 2)
+(< 2 1)
+(if)
+(if false 1)
+(if true)
+(quote (a b))
+'x
+(list)
+(progn)
+(progn 1 2 3)
+(defun f (a b) (list a b))
+(f 1)
+(f 1 2 3)
+((lambda (x) (* x x)) 7)
+(define sq (lambda (x) (* x x)))
+(reduce (lambda (x s) (+ s (sq x))) (list 1 2 3) 0)
+(recur 1)
+(defun g (x) (if (< x 1) 0 (+ 1 (g (- x 1)))))
+(g 100)
+(defun h () 5)
+(h)
+(lambda)
+(defun)
+(defun k)
+(quote)
+(define)
+(defun q () (quote))
+(q)
+((lambda x x) 1)
+((lambda (1) 1) 2)
+(defun bad x 1)
+(bad 1)
+(loop (x) 5 x)
+(loop x (5) x)
+(defun nested () ((lambda x x) 1))
+(nested)
+(loop (x) (5) x)
+(define list 3)
+(list 1 2)
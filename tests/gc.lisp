@@ -0,0 +1,8 @@
+(defun count (n acc) (if (< n 1) acc (count (- n 1) (+ acc 1))))
+(count 2000 0)
+(defun build (n) (if (< n 1) () (list n (build (- n 1)))))
+(build 5)
+(define big (build 300))
+(reduce (lambda (x s) (+ s 1)) (list 1 2 3 4 5 6 7 8 9 10) 0)
+(loop (i acc) (0 (list)) (if (< i 5) (recur (+ i 1) (list i acc)) acc))
+'(a 'b (c))
@@ -0,0 +1,43 @@
+(define h (make_hash))
+h
+(hash_set h 1 'one)
+(hash_set h 'a (list 1 2))
+(hash_set h (list 1 (list 2 'x)) 'nested)
+(hash_set h true 't)
+(hash_set h '() 'empty)
+(hash_get h 1)
+(hash_get h 'a)
+(hash_get h (list 1 (list 2 'x)))
+(hash_get h (list 1 (list 2 'y)))
+(hash_get h (list 1 (list 2 'y)) 'missing)
+(hash_get h true)
+(hash_get h false 'no)
+(hash_get h '())
+(hash_count h)
+(hash_set h 1 'uno)
+(hash_get h 1)
+(hash_count h)
+(hash_remove h 1)
+(hash_remove h 1)
+(hash_get h 1)
+(hash_count h)
+(hash_for_each (lambda (k v) (printl (list k v))) h)
+(hash_keys h)
+(define big (make_hash))
+(loop (i) (0) (if (< i 5000) (progn (hash_set big i (* i i)) (hash_set big (list i 'k) i) (recur (+ i 1))) 0))
+(hash_count big)
+(hash_get big 4999)
+(hash_get big (list 77 'k))
+(loop (i) (0) (if (< i 5000) (progn (hash_remove big i) (recur (+ i 2))) 0))
+(hash_count big)
+(hash_get big 2)
+(hash_get big 3)
+(loop (i) (0) (if (< i 5000) (progn (hash_set big i i) (recur (+ i 2))) 0))
+(hash_count big)
+(hash_get big 4998)
+(define f (lambda (x) x))
+(hash_set big f 'fn)
+(hash_get big f)
+(hash_get big (lambda (x) x))
+(hash_get 3 1)
+(hash_keys (make_hash))
@@ -0,0 +1,9 @@
+(defun fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))
+(define shared '(1 2 3))
+(define saved (list shared shared "text" (int_vector 1 2 3) (vector 'a "b")))
+(define h (make_hash))
+(hash_set h 'key "value")
+(hash_set h '(1 2) 'list_key)
+(define builtin_ref +)
+(save_image "image.img")
+(save_image "missing/image.img")
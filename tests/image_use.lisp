@@ -0,0 +1,10 @@
+(fib 15)
+saved
+(hash_get h 'key)
+(hash_get h '(1 2))
+(hash_count h)
+(builtin_ref 1 2)
+(hash_set h 'new (list 1 2))
+(hash_get h 'new)
+(defun twice (x) (* 2 x))
+(twice (fib 10))
@@ -0,0 +1,10 @@
+(defun build (n acc) (if (< n 1) acc (build (- n 1) (list n acc))))
+(defun len (l) (if (= l ()) 0 (+ 1 (len (reduce (lambda (x s) x) (list 2) 0)))))
+(define a (build 400 ()))
+(define b (build 400 a))
+(defun fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))
+(fib 18)
+(define c (build 300 b))
+(fib 16)
+(reduce (lambda (x s) (+ s x)) (list 1 2 3 4 5 6 7 8 9 10 11 12) 0)
+c
@@ -0,0 +1,21 @@
+(+ 4611686018427387902 1)
+(+ 4611686018427387903 1)
+(- (- 0 4611686018427387903) 1)
+(- (- 0 4611686018427387903) 2)
+(* 2147483648 2147483648)
+(* 4611686018427387903 4611686018427387903)
+(/ 7 2)
+(/ 1 0)
+(/ (- (- 0 4611686018427387903) 1) (- 0 1))
+(defun add (a b) (+ a b))
+(add 4611686018427387903 1)
+(defun divide (a b) (/ a b))
+(divide 1 0)
+(reduce + (list 4611686018427387903 1) 0)
+(reduce * (int_vector 4611686018427387903 3) 1)
+(reduce + (int_vector 1 2 3) 4)
+(define v (int_vector 4611686018427387903 1))
+(vector_sum v)
+(vector_dot v v)
+(vector_sum (vector 4611686018427387903 1))
+(vector_dot (vector 1 2) (vector 3 4))
@@ -0,0 +1,4 @@
+(defun square (x) (* x x))
+(define greeting "hello \"library\"")
+(define table '(1 -2 (three "four") () true false 1234567890123))
+(define loaded (+ (square 3) 1))
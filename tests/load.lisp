@@ -0,0 +1,6 @@
+(load "lib/library.lisp")
+(list (square 12) greeting table loaded)
+(define loaded 0)
+(load "lib/library.lisp")
+(list (square 12) greeting table loaded)
+(load "lib/missing.lisp")
@@ -0,0 +1,27 @@
+"plain"
+"escaped \"quotes\" and \\ backslash"
+(printl "tab\tnewline\n")
+'(a (b (c (d))) "e" 12 -3)
+''x
+(quote ())
+   (+    1
+      2)
+(list 1 2) (list 3 4)
+12345678901234
+abc_DEF_123
+4611686018427387903
+4611686018427387904
+99999999999999999999999 (+ 1 2)
+(list 1                                                                 999999999999999999999999999999999999999999999999999999999999999999999999 2)
+(+ 3 4)
+-4611686018427387904
+-4611686018427387905
+(- 5 -3)
+'(-3 - 3 -a -)
+"a\"b\\c"
+"bad \q escape" 7
+(+ 5 6)
+(list true false)
+)
+(list 1 2
+(+ 1 2)
@@ -0,0 +1,16 @@
+(defun call (fn x) (fn x))
+(defun outer (fn) (call fn 5))
+(outer list)
+(call + 1)
+(call (lambda (y) (* y 2)) 4)
+(call list 7)
+(defun g () (list 1 2))
+(defun shadow (list) (g))
+(g)
+(shadow +)
+(g)
+(defun f (x) (+ x 1))
+(f 1)
+(defun + (a b) (* a b))
+(f 3)
+(call + 6)
@@ -0,0 +1,95 @@
+#!/bin/sh
+# Runs every test in this directory and compares what it prints with what
+# is expected. A test is NAME.lisp, which the REPL reads from stdin, with
+# its output in NAME.expected and optionally more interpreter arguments in
+# NAME.args. Lines about collections depend on the collector, so they are
+# left out. Tests run in order in a scratch copy of this directory, so a
+# test can use the files an earlier one wrote.
+#
+# Every test runs as built normally, and then built with YALP_GC_STRESS,
+# which collects on every allocation, alone, with --gc-pause-budget 1 and
+# with --compact.
+#
+# embed.c is a host program linked against yalp.c built with YALP_NO_MAIN,
+# its output is in embed.expected. It runs as built normally and with
+# YALP_GC_STRESS.
+#
+# Usage: tests/run.sh [--update]
+#   --update rewrites the expected output from a normal build instead
+#   CC and CFLAGS pick the compiler and its flags, for example
+#   CFLAGS="-g -fsanitize=address,undefined" tests/run.sh
+
+here=$(cd "$(dirname "$0")" && pwd)
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+export ASAN_OPTIONS=${ASAN_OPTIONS:-detect_leaks=0}
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+$CC -std=gnu11 $CFLAGS -o "$work/yalp" "$here/../yalp.c" || exit 1
+$CC -std=gnu11 $CFLAGS -DYALP_GC_STRESS -o "$work/yalp_stress" "$here/../yalp.c" || exit 1
+$CC -std=gnu11 $CFLAGS -DYALP_NO_MAIN -c -o "$work/yalp.o" "$here/../yalp.c" || exit 1
+$CC -std=gnu11 $CFLAGS -o "$work/embed" "$here/embed.c" "$work/yalp.o" || exit 1
+$CC -std=gnu11 $CFLAGS -DYALP_NO_MAIN -DYALP_GC_STRESS -c -o "$work/yalp_stress.o" "$here/../yalp.c" || exit 1
+$CC -std=gnu11 $CFLAGS -o "$work/embed_stress" "$here/embed.c" "$work/yalp_stress.o" || exit 1
+
+failed=0
+passed=0
+
+# run_tests MODE BINARY [ARGS...]
+run_tests()
+{
+    mode=$1
+    binary=$2
+    shift 2
+    rm -rf "$work/tests"
+    cp -R "$here" "$work/tests"
+    for test in "$here"/*.lisp; do
+        name=$(basename "$test" .lisp)
+        args=$(cat "$here/$name.args" 2>/dev/null)
+        (cd "$work/tests" && "$binary" "$@" $args < "$name.lisp" 2>&1) | grep -v '^GC' > "$work/output"
+        if [ -n "$update" ]; then
+            cp "$work/output" "$here/$name.expected"
+        elif cmp -s "$work/output" "$here/$name.expected"; then
+            passed=$((passed + 1))
+        else
+            echo "FAIL $name ($mode)"
+            diff "$here/$name.expected" "$work/output" | head -20
+            failed=$((failed + 1))
+        fi
+    done
+}
+
+# run_embed MODE BINARY
+run_embed()
+{
+    "$2" > "$work/output" 2>&1
+    if [ -n "$update" ]; then
+        cp "$work/output" "$here/embed.expected"
+    elif cmp -s "$work/output" "$here/embed.expected"; then
+        passed=$((passed + 1))
+    else
+        echo "FAIL embed ($1)"
+        diff "$here/embed.expected" "$work/output" | head -20
+        failed=$((failed + 1))
+    fi
+}
+
+update=
+if [ "${1:-}" = "--update" ]; then
+    update=1
+    run_tests normal "$work/yalp"
+    run_embed normal "$work/embed"
+    exit 0
+fi
+
+run_tests normal "$work/yalp"
+run_tests stress "$work/yalp_stress"
+run_tests "stress, incremental" "$work/yalp_stress" --gc-pause-budget 1
+run_tests "stress, compacting" "$work/yalp_stress" --compact
+run_embed normal "$work/embed"
+run_embed stress "$work/embed_stress"
+
+echo "$passed passed, $failed failed"
+[ "$failed" -eq 0 ]
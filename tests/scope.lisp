@@ -0,0 +1,21 @@
+(defun dup (a a b) (list a b))
+(dup 1 2 3)
+(defun g (x y) (list x y a))
+(defun f (a b) (g b a))
+(f 1 2)
+(defun h (n) (progn (define n 10) n))
+(h 3)
+(defun ev (n) (if (= n 0) true (od (- n 1))))
+(defun od (m) (if (= m 0) false (ev (- m 1))))
+(ev 10001)
+(defun k (p q) (if (< p 1) (list p q) (kk q p)))
+(defun kk (q p) (k (- p 1) q))
+(k 5 7)
+(defun inner () z)
+(defun outer (z) (inner))
+(outer 42)
+(loop (i acc) (0 0) (if (< i 10) (recur (+ i 1) (+ acc i)) acc))
+(defun noarg () 5)
+(noarg 1 2)
+(defun few (a b c) (list a b c))
+(few 1)
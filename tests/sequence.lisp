@@ -0,0 +1,18 @@
+(map (lambda (x) (* x x)) (list 1 2 3 4))
+(filter (lambda (x) (< x 3)) (list 1 2 3 4 1))
+(reduce + (list 1 2 3 4) 0)
+(reduce (lambda (el s) (+ el s)) (list 1 2 3) 10)
+(reduce list (list 1 2 3) 0)
+(for_each printl (list 1 2 (list 3 4)))
+(map (lambda (x) (list x x)) (list (list 1) 2))
+(map + (list 1 2 3))
+(map (lambda (x) x) '())
+(filter (lambda (x) true) '())
+(reduce + '() 5)
+(map quote (list 1 2))
+(map (lambda (x) (foo x)) (list 1))
+(map 3 (list 1))
+(map + 3)
+(map (lambda (x) (map (lambda (y) (* x y)) (list 1 2))) (list 1 2 3))
+(reduce = (list 1 1) 1)
+(filter (lambda (x) (= x 1)) (list 1 2 1))
@@ -0,0 +1,13 @@
+(loop (i acc) (0 0) (if (< i 20000) (recur (+ i 1) (+ acc i)) acc))
+(defun count (n acc) (if (< n 1) acc (count (- n 1) (+ acc 1))))
+(count 20000 0)
+(defun ev (n) (if (= n 0) true (od (- n 1))))
+(defun od (n) (if (= n 0) false (ev (- n 1))))
+(ev 20001)
+(defun f (x) (g))
+(defun g () (+ x 1))
+(f 41)
+(defun p (n) (progn 1 (if (< n 1) 0 (p (- n 1)))))
+(p 20000)
+(defun q (n) (if (< n 1) (print n) (q (- n 1))))
+(q 20000)
@@ -0,0 +1,61 @@
+(define v (int_vector 1 2 3 4 5 6 7 8 9))
+(define w (make_int_vector 9 2))
+(define o (vector 1 (list 2 3) 'a v))
+o
+(vector_length v)
+(vector_ref v 0)
+(vector_ref v 8)
+(vector_ref v 9)
+(vector_ref o 1)
+(vector_set v 0 100)
+(vector_set v 1 'a)
+(vector_set o 2 (list 4 5))
+o
+(vector_sum v)
+(vector_sum (vector 1 2 3))
+(vector_dot v w)
+(vector_dot v (int_vector 1))
+(vector_equal v v)
+(vector_equal v w)
+(vector_equal (int_vector 1 2 3 4 5) (int_vector 1 2 3 4 5))
+(vector_equal (int_vector 1 2 3 4 6) (int_vector 1 2 3 4 5))
+(vector_equal (vector 1 2) (int_vector 1 2))
+(vector_equal (vector 1 2) (int_vector 1 2 3))
+(vector_map + v w)
+(vector_map - v w)
+(vector_map * v w)
+(vector_map (lambda (x) (* x x)) v)
+(vector_map (lambda (x y) (list x y)) (int_vector 1 2) (vector 'a 'b))
+(vector_map < v w)
+(vector_map + v (int_vector 1))
+(reduce + v 0)
+(reduce * (int_vector 1 2 3 4 5 6 7) 1)
+(reduce (lambda (x s) (+ x s)) v 0)
+(reduce list (vector 1 2) 0)
+(for_each printl (vector 1 (list 2)))
+(make_vector 3)
+(make_vector 2 'x)
+(make_int_vector 3)
+(make_int_vector -1)
+(int_vector 1 'a)
+(vector)
+(int_vector)
+(vector_sum (int_vector))
+(map (lambda (x) x) v)
+(vector_ref 3 0)
+(int_vector -3 2)
+(define n 37)
+(define a (make_int_vector n))
+(define b (make_int_vector n))
+(loop (i) (0) (if (< i n) (progn (vector_set a i (* i 3001)) (vector_set b i (- 1000 (* i i 127))) (recur (+ i 1))) 0))
+(= (vector_sum a) (reduce (lambda (x s) (+ x s)) a 0))
+(= (reduce * (int_vector 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15) 1) (reduce (lambda (x s) (* x s)) (int_vector 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15) 1))
+(= (vector_dot a b) (reduce + (vector_map (lambda (x y) (* x y)) a b) 0))
+(vector_equal (vector_map * a b) (vector_map (lambda (x y) (* x y)) a b))
+(vector_equal (vector_map - a b) (vector_map (lambda (x y) (- x y)) a b))
+(vector_equal (vector_map + a b) (vector_map (lambda (x y) (+ x y)) a b))
+(vector_equal (vector_map + a b) (vector_map (lambda (x y) (list x y)) a b))
+(vector_sum (vector_map - a b))
+(vector_dot a b)
+(make_int_vector 4611686018427387903)
+(vector_length (make_vector 1000))
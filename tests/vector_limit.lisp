@@ -0,0 +1,4 @@
+(make_vector 10000000000000 0)
+(make_int_vector 200000)
+(vector_length (make_int_vector 50000 1))
+(vector_sum (make_int_vector 50000 1))
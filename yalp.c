@@ -3,17 +3,36 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "yalp.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+// Kernels compiled for AVX2 and picked at run time when the CPU has it
+#define AVX2_KERNELS
+#define AVX2 __attribute__((target("avx2")))
+#endif
 
 enum sexpr_t;
 struct sexpr;
 struct env;
-struct sexpr* eval_sexpr(struct env* env, struct sexpr* sexpr);
-struct sexpr* eval_argument(struct env* env, struct sexpr* args, int n);
-struct sexpr* eval_type_argument(struct env* env, struct sexpr* args, int n, enum sexpr_t type);
-struct sexpr* call_lambda(struct env* env, struct sexpr* lambda, struct sexpr* args);
-struct sexpr* read_sexpr(struct env* env, const char** str);
-struct sexpr* create_list(struct env* env, int element_count,  ...);
-struct sexpr* alloc_sexpr(struct env* env);
+static struct sexpr* eval_sexpr(struct env* env, struct sexpr* sexpr);
+static struct sexpr* eval_argument(struct env* env, struct sexpr* args, int n);
+static struct sexpr* eval_type_argument(struct env* env, struct sexpr* args, int n, enum sexpr_t type);
+static struct sexpr* call_lambda(struct env* env, struct sexpr* lambda, struct sexpr* args);
+static struct sexpr* apply_lambda(struct env* env, struct sexpr* lambda, size_t args, int arg_count);
+static struct sexpr* create_list(struct env* env, int element_count,  ...);
+enum size_class;
+static struct sexpr* alloc_sexpr(struct env* env, enum size_class size_class);
+static const char* intern(struct env* env, const char* str, size_t length);
 
 enum sexpr_t
 {
@@ -23,7 +42,11 @@ enum sexpr_t
     integer,
     symbol,
     function,
-    boolean
+    boolean,
+    vector,
+    hash,
+    string,
+    code // Compiled bytecode, only referenced from lambdas and the compiler
 };
 
 enum function_t
@@ -32,1204 +55,6649 @@ enum function_t
     lambda
 };
 
-enum memory_mode_t
-{
-    untracked,
-    tracked
-};
-
 struct sexpr
 {
-    enum memory_mode_t memory_mode;
-    enum sexpr_t tag;
     union
     {
+        // A cons cell is only these two words, the segment it is in tells
+        // that it is a list
         struct
         {
             struct sexpr* head;
             struct sexpr* tail;
         } list;
-        int integer;
-        bool boolean;
-        const char* name;
-        const char* message;
         struct
         {
-            enum function_t tag;
+            enum sexpr_t tag;
             union
             {
+                const char* name;
+                const char* message;
                 struct
                 {
-                    const char* name;
-                    struct sexpr* (*fn) (struct env*, struct sexpr*);
-                } builtin;
-                struct
-                {
-                    struct sexpr* params;
-                    struct sexpr* exprs;
-                } lambda;
+                    enum function_t tag;
+                    union
+                    {
+                        struct
+                        {
+                            const char* name;
+                            struct sexpr* (*fn) (struct env*, struct sexpr*);
+                        } builtin;
+                        struct
+                        {
+                            struct sexpr* params;
+                            struct sexpr* exprs;
+                        } lambda;
+                    };
+                } function;
+                struct code* code;
+                struct vector* vector;
+                struct hash_table* table;
+                char* text;
             };
-        } function;
+        };
     };
-}
-    _NIL = { .memory_mode = untracked, .tag = nil },
-    _S_TRUE = { .memory_mode = untracked, .tag = boolean, .boolean = true},
-    _S_FALSE = { .memory_mode = untracked, .tag = boolean, .boolean = false};
+};
 
-struct sexpr* NIL = &_NIL;
-struct sexpr* S_TRUE = &_S_TRUE;
-struct sexpr* S_FALSE = &_S_FALSE;
+// The heap is made of fixed size segments aligned to their size, so the
+// segment of an object is found by masking its address. Every segment holds
+// blocks of one size class. Mark, used, old and remembered bits live in
+// dense per-segment bitmaps next to the blocks.
+#define SEGMENT_SIZE (256 * 1024)
 
-struct sexpr* new_sexpr(struct env* env, enum sexpr_t tag)
+enum size_class
 {
-    struct sexpr* e = alloc_sexpr(env);
+    cons_class, // Lists, a head and a tail
+    atom_class, // Every other type, a tag and one field
+    function_class // Builtins and lambdas
+};
 
-    e->tag = tag;
-    e->memory_mode = tracked;
+#define SIZE_CLASSES 3
+// Blocks of a class are 1 << shift bytes
+static const unsigned class_shifts[SIZE_CLASSES] = {4, 4, 5};
+// Heap sizes are counted in slots the size of a cons cell
+#define SLOT_SIZE 16
+#define SEGMENT_SLOTS (SEGMENT_SIZE / SLOT_SIZE)
+#define SEGMENT_BITMAP_WORDS ((SEGMENT_SLOTS + 63) / 64)
 
-    return e;
-}
+struct segment
+{
+    struct segment* next;
+    bool needs_sweep;
+    bool mapped; // Part of a heap image mapped from a file, see load_image
+    enum size_class size_class;
+    unsigned block_shift;
+    size_t block_count;
+    uint64_t mark_bits[SEGMENT_BITMAP_WORDS];
+    uint64_t used_bits[SEGMENT_BITMAP_WORDS];
+    uint64_t old_bits[SEGMENT_BITMAP_WORDS]; // Survived a collection
+    uint64_t remembered_bits[SEGMENT_BITMAP_WORDS]; // Old block in the remembered set
+    char blocks[];
+};
 
-struct sexpr* new_integer(struct env* env, int n)
+// Number of blocks of a class that fit in a segment
+static size_t class_blocks(enum size_class size_class)
 {
-    struct sexpr* e = new_sexpr(env, integer);
-    e->integer = n;
-    return e;
+    return (SEGMENT_SIZE - sizeof(struct segment)) >> class_shifts[size_class];
 }
 
-struct sexpr* new_function(struct env* env, enum function_t tag)
+static struct segment* segment_of(struct sexpr* sexpr)
 {
-    struct sexpr* e = new_sexpr(env, function);
-    e->function.tag = tag;
-    return e;
+    return (struct segment*)((uintptr_t)sexpr & ~(uintptr_t)(SEGMENT_SIZE - 1));
 }
 
-struct sexpr* new_symbol(struct env* env, const char* str, size_t length)
+static size_t block_index(struct segment* segment, struct sexpr* sexpr)
 {
-    struct sexpr* e = new_sexpr(env, symbol);
-    e->name = malloc(length + 1);
-    strncpy((char*)e->name, str, length);
-    ((char*)e->name)[length] = '\0';
-    return e;
+    return (size_t)((char*)sexpr - segment->blocks) >> segment->block_shift;
 }
 
-struct sexpr* new_error(struct env* env, const char* message)
+static struct sexpr* block_at(struct segment* segment, size_t index)
 {
-    struct sexpr* e = new_sexpr(env, error);
-    e->message = message;
-    return e;
+    return (struct sexpr*)(segment->blocks + (index << segment->block_shift));
 }
 
-const char* copy_string(const char* str)
+// Bitmap words that cover the blocks of a segment
+static size_t bitmap_words(struct segment* segment)
 {
-    char* copy = malloc(strlen(str) + 1);
-    strcpy(copy, str);
-    return copy;
+    return (segment->block_count + 63) / 64;
 }
 
-#define CHECK_ERROR(expr) if (!expr || expr->tag == error) return expr;
+static bool test_bit(const uint64_t* bits, size_t index)
+{
+    return (bits[index / 64] >> (index % 64)) & 1;
+}
 
-struct binding
+static void set_bit(uint64_t* bits, size_t index)
 {
-    const char* name;
-    struct sexpr* value;
-};
+    bits[index / 64] |= 1ULL << (index % 64);
+}
 
-struct frame
+static void clear_bit(uint64_t* bits, size_t index)
 {
-    struct binding* bindings;
-    int binding_count;
-    struct frame* previous;
-    struct sexpr* context;
-};
+    bits[index / 64] &= ~(1ULL << (index % 64));
+}
 
-struct frame* create_frame()
+// Bits of a bitmap word that correspond to blocks in the segment
+static uint64_t block_word_mask(struct segment* segment, size_t word)
 {
-    struct frame* frame = malloc(sizeof(struct frame));
-    frame->bindings = NULL;
-    frame->binding_count = 0;
-    frame->previous = NULL;
-    frame->context = NULL;
-    return frame;
+    if (word == segment->block_count / 64 && segment->block_count % 64)
+        return (1ULL << (segment->block_count % 64)) - 1;
+    return word < segment->block_count / 64 ? ~0ULL : 0;
 }
 
-void delete_binding(struct binding* binding) {
-    free((void *)binding->name);
-    binding->name = NULL;
-    binding->value = NULL;
+// Integers, booleans and NIL are immediates: they are encoded in the pointer
+// itself and never allocated. Heap objects are aligned, so a set low bit
+// marks an integer, shifted left by one, and the next bit the constants.
+#define NIL ((struct sexpr*)(uintptr_t)0x2)
+#define S_FALSE ((struct sexpr*)(uintptr_t)0x6)
+#define S_TRUE ((struct sexpr*)(uintptr_t)0xa)
+// Returned when an allocation fails, so it must not need allocating itself
+#define MEMORY_ERROR ((struct sexpr*)(uintptr_t)0xe)
+
+static bool is_immediate(struct sexpr* sexpr)
+{
+    return (uintptr_t)sexpr & 3;
 }
 
-void remove_binding(struct frame* frame, const char* name, bool recursive)
+static enum sexpr_t tag_of(struct sexpr* sexpr)
 {
-    for(int i=0;i<frame->binding_count;i++)
-    {
-        struct binding* binding = &frame->bindings[i];
-        if (binding->name && strcmp(binding->name, name) == 0)
-        {
-            delete_binding(binding);
-            return;
-        }
-    }
+    if ((uintptr_t)sexpr & 1)
+        return integer;
+    if ((uintptr_t)sexpr & 2)
+        return sexpr == NIL ? nil : sexpr == MEMORY_ERROR ? error : boolean;
+    return segment_of(sexpr)->size_class == cons_class ? list : sexpr->tag;
+}
 
-    if (frame->previous && recursive)
-        remove_binding(frame->previous, name, recursive);
+// Whether sexpr is a heap object the collector manages
+static bool is_tracked(struct sexpr* sexpr)
+{
+    return sexpr && !is_immediate(sexpr);
 }
 
-void add_binding(struct frame* frame, const char* name, struct sexpr* value)
+static const char* error_message(struct sexpr* sexpr)
 {
-    // Try reusing a free spot
-    for (int i=0;i<frame->binding_count;i++)
-    {
-        struct binding* binding = &frame->bindings[i];
-        if (binding->name && strcmp(binding->name, name) == 0)
-        {
-            delete_binding(binding);
-        } else if (binding->name == NULL)
-        {
-            binding->name = copy_string(name);
-            binding->value = value;
-            return;
-        }
-    }
+    return sexpr == MEMORY_ERROR ? "Out of memory" : sexpr->message;
+}
 
-    frame->bindings = realloc(frame->bindings, sizeof(struct binding) * (frame->binding_count+1));
-    frame->binding_count += 1;
-    frame->bindings[frame->binding_count-1].name = copy_string(name);
-    frame->bindings[frame->binding_count-1].value = value;
+// Integers are as wide as a pointer minus the tag bit, 63 bits on 64 bit hosts
+#define INTEGER_MAX (INTPTR_MAX >> 1)
+#define INTEGER_MIN (INTPTR_MIN >> 1)
+
+static intptr_t integer_value(struct sexpr* sexpr)
+{
+    return (intptr_t)sexpr >> 1;
 }
 
-struct sexpr* get_binding(struct frame* frame, const char* name)
+// Bytecode of a lambda body or a top level form, see compile_form
+struct code
 {
-    for(int i=0;i<frame->binding_count;i++)
-    {
-        if (frame->bindings[i].name && strcmp(frame->bindings[i].name, name) == 0)
-            return frame->bindings[i].value;
-    }
+    int* ops;
+    size_t op_count;
+    struct sexpr** constants;
+    size_t constant_count;
+    // Most values the code keeps on the value stack at once
+    size_t max_depth;
+    // Slots bind_params uses for the parameters of the lambda
+    int param_slots;
+};
 
-    if (frame->previous)
-        return get_binding(frame->previous, name);
+// The reader is a state machine fed one chunk of input at a time, so a form
+// may be split anywhere between chunks. The lists it is in the middle of
+// are on a stack that is a GC root, see read_chunk.
+enum reader_state
+{
+    between_tokens,
+    in_minus, // A - that starts a negative integer if a digit follows
+    in_integer,
+    in_symbol,
+    in_string,
+    in_string_escape,
+    skipping_line // The rest of a line with a syntax error
+};
 
-    return NULL;
-}
+struct open_form
+{
+    bool quote; // A quote waiting for the form it quotes
+    struct sexpr* head;
+    struct sexpr* last;
+};
 
-void free_frame(struct frame* frame)
+struct reader
 {
-    for (int i=0;i<frame->binding_count;i++)
-    {
-        if (frame->bindings[i].name)
-            delete_binding(&frame->bindings[i]);
-    }
-    free(frame);
-}
+    enum reader_state state;
+    // Characters of the token being read, it may span chunks. Integers are
+    // accumulated in number instead, negative ones downwards so that
+    // INTEGER_MIN can be read.
+    intptr_t number;
+    bool negative;
+    char* token;
+    size_t token_length;
+    size_t token_capacity;
+    struct open_form* open;
+    size_t depth;
+    size_t open_capacity;
+    // A completed form on its way into the lists that contain it
+    struct sexpr* form;
+    struct reader* previous;
+};
 
-struct block
+// Code being compiled, its constants are GC roots
+struct compiler
 {
-    struct sexpr sexpr;
-    bool marked: 1;
-    bool used: 1;
+    int* ops;
+    size_t op_count;
+    size_t op_capacity;
+    struct sexpr** constants;
+    size_t constant_count;
+    size_t constant_capacity;
+    size_t depth;
+    size_t max_depth;
+    // Parameters of the lambda being compiled, NULL for top level forms
+    struct sexpr* params;
+    struct compiler* previous;
 };
 
-#define HEAP_SIZE 65536
+static void free_code(struct code* code)
+{
+    free(code->ops);
+    free(code->constants);
+    free(code);
+}
 
-struct env
+// Vectors keep their elements in one malloc'd block outside the heap. Int
+// vectors hold plain 64 bit integers so the numeric builtins can run SIMD
+// kernels over them, the others hold any value and are traced by the GC.
+enum vector_t
 {
-    struct block heap[HEAP_SIZE];
-    struct frame* stack;
+    object_vector,
+    int_vector
 };
 
-size_t available_heap_space(struct env* env)
+struct vector
 {
-    size_t free_slots = 0;
-    for (int i=0;i<HEAP_SIZE;i++)
+    enum vector_t type;
+    size_t length;
+    union
     {
-        if (!env->heap[i].used)
-            free_slots++;
-    }
+        struct sexpr** items;
+        int64_t* ints;
+    };
+};
 
-    return free_slots;
+static size_t vector_data_size(struct vector* vector)
+{
+    return vector->length * (vector->type == int_vector ? sizeof(int64_t) : sizeof(struct sexpr*));
 }
 
-struct sexpr* alloc_sexpr(struct env* env)
+static void free_vector(struct vector* vector)
 {
-    for (int i=0; i<HEAP_SIZE;i++)
-    {
-        struct block* block = &env->heap[i];
-        if (!block->used)
-        {
-            memset(block, 0, sizeof(struct block));
-            block->used = true;
-            return &block->sexpr;
-        }
-    }
+    free(vector->items);
+    free(vector);
+}
+
+// Open addressing hash table with linear probing, its arrays are malloc'd
+// like vector storage. A key slot is NULL when it was never used and
+// HASH_REMOVED when its entry was removed.
+struct hash_table
+{
+    size_t count; // Entries in the table
+    size_t used; // Slots that aren't NULL
+    size_t capacity; // Always a power of two
+    struct sexpr** keys;
+    struct sexpr** values;
+};
 
-    static struct sexpr memory_error = {.memory_mode = untracked, .tag = error};
-    memory_error.message = "Out of memory";
+#define HASH_REMOVED ((struct sexpr*)(uintptr_t)0x12)
 
-    printf("Out of memory!\n");
-    return &memory_error;
+static size_t hash_table_size(struct hash_table* table)
+{
+    return sizeof(struct hash_table) + table->capacity * 2 * sizeof(struct sexpr*);
 }
 
-void mark_sexpr(struct sexpr* sexpr)
+static void free_hash_table(struct hash_table* table)
 {
-    if (sexpr->memory_mode == tracked)
-    {
-        struct block* block = (struct block*) sexpr;
-        if (block->marked)
-            return; 
-        block->marked = true;
-    }
+    free(table->keys);
+    free(table->values);
+    free(table);
+}
 
-    switch (sexpr->tag)
+// Frees what an object owns outside the heap
+static void free_external(struct sexpr* object)
+{
+    switch (object->tag)
     {
-        case list:
-            mark_sexpr(sexpr->list.head);
-            mark_sexpr(sexpr->list.tail);
+        case code:
+            free_code(object->code);
             break;
-        case function:
-            if (sexpr->function.tag == lambda)
-            {
-                mark_sexpr(sexpr->function.lambda.params);
-                mark_sexpr(sexpr->function.lambda.exprs);
-            }
+        case vector:
+            free_vector(object->vector);
+            break;
+        case string:
+            free(object->text);
+            break;
+        default:
+            free_hash_table(object->table);
             break;
     }
 }
 
-void mark_frame(struct frame* frame)
+static struct sexpr* new_sexpr(struct env* env, enum sexpr_t tag)
 {
-    for (int i=0;i<frame->binding_count;i++)
-    {
-        struct binding* binding = &frame->bindings[i];
-        if (binding->name && binding->value)
-        {
-            mark_sexpr(binding->value);
-        }
-    }
-    // TODO: Mark context
+    if (tag == list)
+        return alloc_sexpr(env, cons_class);
+
+    struct sexpr* e = alloc_sexpr(env, tag == function ? function_class : atom_class);
+    if (e == MEMORY_ERROR)
+        return e;
 
-    if (frame->previous)
-        mark_frame(frame->previous);
+    e->tag = tag;
+    return e;
 }
 
-void mark_roots(struct env* env)
+static struct sexpr* new_integer(struct env* env, intptr_t n)
 {
-    mark_frame(env->stack);
+    return (struct sexpr*)(((uintptr_t)n << 1) | 1);
 }
 
-void sweep_heap(struct env* env)
+static struct sexpr* new_function(struct env* env, enum function_t tag)
 {
-    for (int i=0;i<HEAP_SIZE;i++)
-    {
-        struct block* block = &env->heap[i];
-
-        if (!block->marked)
-        {
-            block->used = false;
-        }
-
-        block->marked = false;
-    }
+    struct sexpr* e = new_sexpr(env, function);
+    if (e == MEMORY_ERROR)
+        return e;
+    e->function.tag = tag;
+    return e;
 }
 
-void collect_garbage(struct env* env)
+static struct sexpr* new_symbol(struct env* env, const char* str, size_t length)
 {
-    size_t available_before = available_heap_space(env);
-    mark_roots(env);
-    sweep_heap(env);
-    size_t available_after = available_heap_space(env);
-
-    printf("GC collected %d objects, heap now has %d slots available\n", available_after - available_before, available_after);
+    struct sexpr* e = new_sexpr(env, symbol);
+    if (e == MEMORY_ERROR)
+        return e;
+    e->name = intern(env, str, length);
+    return e;
 }
 
-struct sexpr* get_env_binding(struct env* env, const char* name)
+static struct sexpr* new_error(struct env* env, const char* message)
 {
-    return get_binding(env->stack, name);
+    struct sexpr* e = new_sexpr(env, error);
+    if (e == MEMORY_ERROR)
+        return e;
+    e->message = message;
+    return e;
 }
 
-void add_env_binding(struct env* env, const char* name, struct sexpr* val)
+static void add_external_object(struct env* env, struct sexpr* object);
+
+// The message names the symbol. It is interned so that it lives as long as
+// env, like the names themselves.
+static struct sexpr* unknown_symbol_error(struct env* env, const char* name)
 {
-    add_binding(env->stack, name, val);
+    size_t length = strlen("Unknown symbol: ") + strlen(name);
+    char* message = malloc(length + 1);
+    if (!message)
+        return new_error(env, "Unknown symbol");
+    snprintf(message, length + 1, "Unknown symbol: %s", name);
+    struct sexpr* error = new_error(env, intern(env, message, length));
+    free(message);
+    return error;
 }
 
-void remove_env_binding(struct env* env, const char* name, bool recursive)
+// Strings own a malloc'd copy of their text
+static struct sexpr* new_string(struct env* env, const char* str, size_t length)
 {
-    remove_binding(env->stack, name, recursive);
+    struct sexpr* e = new_sexpr(env, string);
+    if (e == MEMORY_ERROR)
+        return e;
+    e->text = malloc(length + 1);
+    memcpy(e->text, str, length);
+    e->text[length] = '\0';
+    add_external_object(env, e);
+    return e;
 }
 
-void add_env_builtin_function(struct env* env, const char* name, struct sexpr* (*fn) (struct env* env, struct sexpr*))
+#define CHECK_ERROR(expr) if (!expr || tag_of(expr) == error) return expr;
+
+// Every interned name has a cell with the value of its innermost binding,
+// so looking up a name doesn't depend on how many frames there are. Frames
+// keep the values they shadow and put them back when they are popped.
+struct symbol_cell
 {
-    struct sexpr* v = new_function(env, builtin);
-    v->function.builtin.name = copy_string(name);
-    v->function.builtin.fn = fn;
+    struct sexpr* value;
+    uint32_t hash; // hash_string of the name
+    char name[];
+};
 
-    add_env_binding(env, name, v);
+static struct symbol_cell* cell_of(const char* name)
+{
+    return (struct symbol_cell*)(name - offsetof(struct symbol_cell, name));
 }
 
-void push_stack_frame(struct env* env, struct sexpr* context)
+// Names of bindings are interned, see intern, so they are compared by address
+struct binding
 {
-    struct frame* frame = create_frame();
-    frame->previous = env->stack;
-    frame->context = context;
-    env->stack = frame;
+    const char* name;
+    struct sexpr* value;
+    // Value of the name before this binding was made
+    struct sexpr* shadowed;
+};
+
+// Frames and their bindings are carved out of chunks that are used like a
+// stack, as frames are popped in the reverse order they are pushed
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+struct arena_chunk
+{
+    struct arena_chunk* previous;
+    char* top;
+    char* end;
+    char data[];
+};
+
+struct frame_arena
+{
+    struct arena_chunk* chunk;
+    // The last released chunk, kept so calls going back and forth over a
+    // chunk boundary don't allocate every time
+    struct arena_chunk* spare;
+};
+
+static void* arena_alloc(struct frame_arena* arena, size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+    struct arena_chunk* chunk = arena->chunk;
+    if (!chunk || chunk->top + size > chunk->end)
+    {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = arena->spare;
+        arena->spare = NULL;
+        if (!chunk || (size_t)(chunk->end - chunk->data) < chunk_size)
+        {
+            free(chunk);
+            chunk = malloc(sizeof(struct arena_chunk) + chunk_size);
+            chunk->end = chunk->data + chunk_size;
+        }
+        chunk->previous = arena->chunk;
+        chunk->top = chunk->data;
+        arena->chunk = chunk;
+    }
+
+    void* memory = chunk->top;
+    chunk->top += size;
+    return memory;
 }
 
-void pop_stack_frame(struct env* env)
+// Grows the last allocation, which ends at end, if it fits in its chunk
+static bool arena_extend(struct frame_arena* arena, void* end, size_t size)
 {
-    struct frame* new_top = env->stack->previous;
-    free_frame(env->stack);
-    env->stack = new_top;
+    struct arena_chunk* chunk = arena->chunk;
+    if (!chunk || chunk->top != (char*)end || chunk->top + size > chunk->end)
+        return false;
+
+    chunk->top += size;
+    return true;
 }
 
-struct sexpr* next(struct sexpr** list)
+// Frees everything allocated after top of chunk was reached
+static void arena_release(struct frame_arena* arena, struct arena_chunk* chunk, char* top)
 {
-    if (*list == NIL)
-        return NULL;
+    while (arena->chunk != chunk)
+    {
+        struct arena_chunk* released = arena->chunk;
+        arena->chunk = released->previous;
+        free(arena->spare);
+        arena->spare = released;
+    }
+    if (chunk)
+        chunk->top = top;
+}
 
-    struct sexpr* element = (*list)->list.head;
-    *list =(*list)->list.tail;
-    return element;
+static void free_arena(struct frame_arena* arena)
+{
+    arena_release(arena, NULL, NULL);
+    free(arena->spare);
+    arena->spare = NULL;
 }
 
-int list_length(struct sexpr* list)
+// Frames with more bindings than this, like the global one, get a hash
+// index so that lookups don't depend on the number of bindings
+#define FRAME_INDEX_THRESHOLD 8
+
+struct frame
 {
-    int count = 0;
-    while (next(&list)) count++;
-    return count;
+    // Bindings start out right after the frame in the arena
+    struct binding* bindings;
+    int binding_count;
+    int binding_capacity;
+    // Open addressing table of binding positions plus one, zero is empty.
+    // Entries of deleted or reused bindings stay until the index is rebuilt.
+    int* index;
+    size_t index_capacity;
+    size_t index_used;
+    struct frame* previous;
+    struct sexpr* context;
+    struct frame_arena* arena;
+    // Where the arena was before the frame was allocated
+    struct arena_chunk* arena_chunk;
+    char* arena_top;
+};
+
+static struct frame* create_frame(struct frame_arena* arena, int binding_capacity)
+{
+    struct arena_chunk* chunk = arena->chunk;
+    char* top = chunk ? chunk->top : NULL;
+
+    struct frame* frame = arena_alloc(arena, sizeof(struct frame) + sizeof(struct binding) * binding_capacity);
+    frame->bindings = (struct binding*)(frame + 1);
+    frame->binding_count = 0;
+    frame->binding_capacity = binding_capacity;
+    frame->index = NULL;
+    frame->index_capacity = 0;
+    frame->index_used = 0;
+    frame->previous = NULL;
+    frame->context = NULL;
+    frame->arena = arena;
+    frame->arena_chunk = chunk;
+    frame->arena_top = top;
+    return frame;
 }
 
-struct sexpr* reduce(struct sexpr* (*fn) (struct sexpr*, struct sexpr*), struct sexpr* list, struct sexpr* state)
+// Bindings are grown in place when the frame is the last thing in the
+// arena, which it is unless it's the global frame and a lambda is running
+static void grow_bindings(struct frame* frame)
 {
-    struct sexpr* el;
-    while ((el = next(&list)))
-        state = fn(el, state);
-    return state;
+    int capacity = frame->binding_capacity ? frame->binding_capacity * 2 : 4;
+    size_t extra = sizeof(struct binding) * (capacity - frame->binding_capacity);
+    if (!arena_extend(frame->arena, frame->bindings + frame->binding_capacity, extra))
+    {
+        struct binding* bindings = arena_alloc(frame->arena, sizeof(struct binding) * capacity);
+        memcpy(bindings, frame->bindings, sizeof(struct binding) * frame->binding_count);
+        frame->bindings = bindings;
+    }
+    frame->binding_capacity = capacity;
 }
 
-bool is_digit(char c)
+static void make_binding(struct binding* binding, const char* name, struct sexpr* value)
 {
-    return c >= '0' && c <= '9';
+    struct symbol_cell* cell = cell_of(name);
+    binding->name = name;
+    binding->value = value;
+    binding->shadowed = cell->value;
+    cell->value = value;
 }
 
-bool is_whitespace(char c)
+static void set_binding_value(struct binding* binding, struct sexpr* value)
 {
-    return c == ' ' || c == '\r' || c == '\n' || c == '\t';
+    binding->value = value;
+    cell_of(binding->name)->value = value;
 }
 
-void skip_whitespace(const char** str)
+static size_t hash_name(const char* name)
 {
-    for (;(**str) != '\0' && is_whitespace(**str); (*str)++);
+    uint64_t hash = ((uintptr_t)name >> 3) * 0x9e3779b97f4a7c15ULL;
+    return (size_t)(hash ^ (hash >> 32));
 }
 
-bool is_prefix(const char* prefix, const char* str)
+static void insert_index(struct frame* frame, int position)
 {
-    return strncmp(prefix, str, strlen(prefix)) == 0;
+    size_t mask = frame->index_capacity - 1;
+    size_t slot = hash_name(frame->bindings[position].name) & mask;
+    while (frame->index[slot])
+        slot = (slot + 1) & mask;
+    frame->index[slot] = position + 1;
+    frame->index_used++;
 }
 
-struct sexpr* read_boolean(const char** str)
+static void rebuild_index(struct frame* frame)
 {
-    if (is_prefix("true", *str))
-    {
-        (*str) += 4;
-        return S_TRUE;
-    }
-    else if (is_prefix("false", *str))
+    frame->index_capacity = 16;
+    while (frame->index_capacity < (size_t)frame->binding_count * 4)
+        frame->index_capacity *= 2;
+
+    free(frame->index);
+    frame->index = calloc(frame->index_capacity, sizeof(int));
+    frame->index_used = 0;
+
+    for (int i=0;i<frame->binding_count;i++)
     {
-        (*str) += 5;
-        return S_FALSE;
+        if (frame->bindings[i].name)
+            insert_index(frame, i);
     }
+}
 
-    return false;
+static void index_binding(struct frame* frame, int position)
+{
+    if ((frame->index_used + 1) * 2 > frame->index_capacity)
+        rebuild_index(frame);
+    else
+        insert_index(frame, position);
 }
 
-struct sexpr* read_integer(struct env* env, const char** str)
+static struct binding* find_binding(struct frame* frame, const char* name)
 {
-    if (is_digit(**str))
+    if (frame->index)
     {
-        int number = 0;
-        while (is_digit(**str))
+        size_t mask = frame->index_capacity - 1;
+        for (size_t slot = hash_name(name) & mask; frame->index[slot]; slot = (slot + 1) & mask)
         {
-            number = number * 10 + (**str) - '0';
-            (*str)++;
+            struct binding* binding = &frame->bindings[frame->index[slot] - 1];
+            if (binding->name == name)
+                return binding;
         }
-        struct sexpr* atom = new_sexpr(env, integer);
-        atom->integer = number;
-        return atom;
+        return NULL;
     }
-    else
+
+    for (int i=0;i<frame->binding_count;i++)
     {
-        return NULL;
+        if (frame->bindings[i].name == name)
+            return &frame->bindings[i];
     }
+    return NULL;
 }
 
-bool is_symbol_character(char c)
+// Adds a binding after the existing ones and returns its position
+static int append_binding(struct frame* frame, const char* name, struct sexpr* value)
 {
-    return
-        (c >= 'a' && c <= 'z') ||
-        (c >= 'A' && c <= 'Z') ||
-        (c >= '0' && c <= '9') ||
-        (c == '_');
+    if (frame->binding_count == frame->binding_capacity)
+        grow_bindings(frame);
+
+    int position = frame->binding_count++;
+    make_binding(&frame->bindings[position], name, value);
+
+    if (frame->index)
+        index_binding(frame, position);
+    else if (frame->binding_count > FRAME_INDEX_THRESHOLD)
+        rebuild_index(frame);
+
+    return position;
 }
 
-bool is_operator(char c)
+// Binds name in frame, replacing the value if the frame already binds it.
+// Bindings are only ever added to the innermost frame.
+static void add_binding(struct frame* frame, const char* name, struct sexpr* value)
 {
-    switch(c)
+    struct binding* binding = find_binding(frame, name);
+    if (binding)
     {
-        case '+':
-        case '-':
-        case '*':
-        case '/':
-        case '=':
-        case '<':
-            return true;
-        default:
-            return false;
+        set_binding_value(binding, value);
+        return;
     }
-}
 
-struct sexpr* read_operator(struct env* env, const char** str)
-{
-    if (is_operator(**str))
+    // Try reusing a free spot
+    for (int i=0;i<frame->binding_count && !frame->index;i++)
     {
-        struct sexpr* s = new_symbol(env, *str, 1);
-        (*str)++;
-        return s;
+        if (frame->bindings[i].name == NULL)
+        {
+            make_binding(&frame->bindings[i], name, value);
+            return;
+        }
     }
 
-    return NULL;
+    append_binding(frame, name, value);
 }
 
-struct sexpr* read_symbol(struct env* env, const char** str)
+// Binds name at position slot, moving a binding that is already there out
+// of the way. Returns false, binding nothing new, if name is bound before
+// slot already.
+static bool bind_slot(struct frame* frame, int slot, const char* name, struct sexpr* value)
 {
-    struct sexpr* s;
-    if ((s = read_operator(env, str)))
-        return s;
-
-    if (!is_symbol_character(**str) || is_digit(**str))
+    if (slot < frame->binding_count && frame->bindings[slot].name == name)
     {
-        return NULL;
+        set_binding_value(&frame->bindings[slot], value);
+        return true;
     }
 
-    int count;
-    for (count = 0;is_symbol_character((*str)[count]);count++);
+    struct binding* existing = find_binding(frame, name);
+    int position = existing ? (int)(existing - frame->bindings) : append_binding(frame, name, value);
+    set_binding_value(&frame->bindings[position], value);
+    if (position < slot)
+        return false;
 
-    s = new_symbol(env, *str, count);
-    (*str) += count;
-    return s;
+    if (position != slot)
+    {
+        struct binding moved = frame->bindings[slot];
+        frame->bindings[slot] = frame->bindings[position];
+        frame->bindings[position] = moved;
+        if (frame->index)
+            rebuild_index(frame);
+    }
+    return true;
 }
-struct sexpr* create_list(struct env* env, int element_count, ...)
+
+static struct sexpr* get_binding(const char* name)
 {
-    struct sexpr* head = NIL;
-    struct sexpr* previous = NULL;
-    va_list valist;
-    va_start(valist, element_count);
-
-    for (int i=0;i<element_count;i++)
-    {
-        struct sexpr* element = va_arg(valist, struct sexpr*);
-        struct sexpr* cell = new_sexpr(env, list);
-        cell->list.head = element;
-        cell->list.tail = NIL;
-        if (previous)
-            previous->list.tail = cell;
-        else
-            head = cell;
-
-        previous = cell;
-    }
-
-    va_end(valist);
-
-    return head;
+    return cell_of(name)->value;
 }
 
-struct sexpr* read_quote(struct env* env, const char** str)
+// Puts back the values the bindings of frame shadow
+static void unbind_frame(struct frame* frame)
 {
-    if (**str == '\'')
+    for (int i=frame->binding_count - 1;i>=0;i--)
     {
-        (*str)++;
-        struct sexpr* s = new_sexpr(env, symbol);
-        s->name = "quote";
-        return create_list(env, 2, s, read_sexpr(env, str));
+        if (frame->bindings[i].name)
+            cell_of(frame->bindings[i].name)->value = frame->bindings[i].shadowed;
     }
+}
 
-    return NULL;
+// Frees the frame and everything allocated in the arena after it
+static void free_frame(struct frame* frame)
+{
+    free(frame->index);
+    arena_release(frame->arena, frame->arena_chunk, frame->arena_top);
 }
 
-struct sexpr* read_list(struct env* env, const char** str)
+struct heap_config
 {
-    if ((**str) == '(')
-    {
-        (*str)++;
-        struct sexpr* head = NIL;
-        struct sexpr* previous = NULL;
+    // Sizes in slots, see SLOT_SIZE
+    size_t initial_slots;
+    size_t max_slots;
+    // The heap grows by this factor when a collection leaves less than
+    // (1 - 1/factor) of it free, and after a collection it is shrunk back
+    // towards live objects times this factor
+    double growth_factor;
+    // Number of allocations between minor collections
+    size_t nursery_blocks;
+    // Maximum duration of a single incremental collection step, zero makes
+    // full collections stop the world
+    long pause_budget_us;
+    // Copy live objects together between top level forms after full collections
+    bool compact;
+};
 
-        while (true)
-        {
-            skip_whitespace(str);
-            if ((*str)[0] == ')')
-                break;
+// Incremental collections start when less than this fraction of the heap is free
+#define INCREMENTAL_START_FREE_FRACTION 0.25
+// Number of allocations between incremental collection steps
+#define INCREMENTAL_STEP_INTERVAL 256
+// Objects scanned between checks of the step deadline
+#define INCREMENTAL_WORK_CHUNK 64
 
-            struct sexpr* cell = new_sexpr(env, list);
-            cell->list.head = read_sexpr(env, str);
-            cell->list.tail = NIL;
+static struct heap_config default_heap_config()
+{
+    struct heap_config config = {
+        .initial_slots = 4096,
+        .max_slots = 0, // Unlimited
+        .growth_factor = 2.0,
+        .nursery_blocks = 2048,
+        .pause_budget_us = 0,
+        .compact = false
+    };
+    return config;
+}
 
-            if (previous)
-                previous->list.tail = cell;
-            else
-                head = cell;
+enum gc_phase_t
+{
+    gc_idle,
+    gc_marking,
+    gc_sweeping
+};
 
-            previous = cell;
-        }
-        (*str)++;
+// Allocation state of one size class
+struct heap_class
+{
+    size_t blocks;
+    // Free blocks, counting dead blocks in segments that aren't swept yet
+    size_t free_count;
+    // Allocation cursor, free bits of the current bitmap word are cached
+    struct segment* alloc_segment;
+    size_t alloc_word;
+    uint64_t alloc_bits;
+};
+
+struct env
+{
+    struct heap_config heap_config;
+    struct segment* segments;
+    size_t segment_count;
+    struct heap_class classes[SIZE_CLASSES];
+    // Segments are swept lazily, when the allocator reaches them
+    struct segment* sweep_segment;
+    size_t sweep_pending;
+    // Blocks allocated since the last collection, i.e. the young generation
+    struct sexpr** nursery;
+    size_t nursery_count;
+    size_t nursery_capacity;
+    // Old blocks that were written to since the last collection and may
+    // point to young blocks, see write_barrier
+    struct sexpr** remembered;
+    size_t remembered_count;
+    size_t remembered_capacity;
+    bool collecting_young;
+    // Marked objects whose children haven't been scanned yet
+    struct sexpr** gray;
+    size_t gray_count;
+    size_t gray_capacity;
+    // State of an incremental full collection
+    enum gc_phase_t gc_phase;
+    size_t allocs_since_step;
+    long long max_pause_ns;
+    // Full collections so far, and how many had run at the last compaction
+    size_t full_collections;
+    size_t compacted_collections;
+    // Open addressing hash set with one copy of every symbol name
+    const char** interned;
+    size_t interned_count;
+    size_t interned_capacity;
+    struct frame* stack;
+    struct frame_arena frame_arena;
+    // Operands and arguments of running bytecode
+    struct sexpr** values;
+    size_t value_count;
+    size_t value_capacity;
+    struct compiler* compiler;
+    struct reader* reader;
+    // Whether sources are run from and cached to their cache files, see
+    // eval_source
+    bool form_cache;
+    // Every code, vector, hash table and string object, what they own
+    // outside the heap is freed when they are collected
+    struct sexpr** external_objects;
+    size_t external_object_count;
+    size_t external_object_capacity;
+    // Storage outside the heap allocated since the last young collection
+    size_t external_bytes;
+    // Shadow stack with the addresses of C locals that hold heap references
+    // across allocations, see push_root
+    struct sexpr*** roots;
+    size_t root_count;
+    size_t root_capacity;
+#ifdef YALP_GC_STRESS
+    unsigned stress_count;
+#endif
+};
 
-        return head;
+// Registers a local variable as a GC root. Roots pushed while inside
+// eval_sexpr are dropped when it returns, so builtins only
+// push and never pop. The variable must always hold NULL or a valid sexpr.
+static void push_root(struct env* env, struct sexpr** root)
+{
+    if (env->root_count == env->root_capacity)
+    {
+        env->root_capacity = env->root_capacity ? env->root_capacity * 2 : 64;
+        env->roots = realloc(env->roots, sizeof(struct sexpr**) * env->root_capacity);
     }
-    else
+    env->roots[env->root_count++] = root;
+}
+
+static void add_external_object(struct env* env, struct sexpr* object)
+{
+    if (env->external_object_count == env->external_object_capacity)
     {
-        return NULL;
+        env->external_object_capacity = env->external_object_capacity ? env->external_object_capacity * 2 : 64;
+        env->external_objects = realloc(env->external_objects, sizeof(struct sexpr*) * env->external_object_capacity);
     }
+    env->external_objects[env->external_object_count++] = object;
+}
 
+// Makes room for count more values on the value stack
+static void reserve_values(struct env* env, size_t count)
+{
+    if (env->value_count + count > env->value_capacity)
+    {
+        while (env->value_count + count > env->value_capacity)
+            env->value_capacity = env->value_capacity ? env->value_capacity * 2 : 256;
+        env->values = realloc(env->values, sizeof(struct sexpr*) * env->value_capacity);
+    }
 }
 
-struct sexpr* read_sexpr(struct env* env, const char** str)
+static uint32_t hash_string(const char* str, size_t length)
 {
-    struct sexpr* e = NULL;
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (size_t i=0;i<length;i++)
+        hash = (hash ^ (unsigned char)str[i]) * 16777619u;
+    return hash;
+}
 
-    // Skip spaces
-    skip_whitespace(str);
+// Returns the unique copy of a name, so names can be compared by address
+static const char* intern(struct env* env, const char* str, size_t length)
+{
+    if (env->interned_count * 2 >= env->interned_capacity)
+    {
+        size_t old_capacity = env->interned_capacity;
+        const char** old = env->interned;
+        env->interned_capacity = old_capacity ? old_capacity * 2 : 256;
+        env->interned = calloc(env->interned_capacity, sizeof(const char*));
+        for (size_t i=0;i<old_capacity;i++)
+        {
+            if (!old[i])
+                continue;
+            size_t slot = cell_of(old[i])->hash & (env->interned_capacity - 1);
+            while (env->interned[slot])
+                slot = (slot + 1) & (env->interned_capacity - 1);
+            env->interned[slot] = old[i];
+        }
+        free(old);
+    }
 
-    if ((e = read_integer(env, str)))
-        return e;
+    uint32_t hash = hash_string(str, length);
+    size_t slot = hash & (env->interned_capacity - 1);
+    for (;env->interned[slot];slot = (slot + 1) & (env->interned_capacity - 1))
+    {
+        const char* name = env->interned[slot];
+        if (strncmp(name, str, length) == 0 && name[length] == '\0')
+            return name;
+    }
 
-    if ((e = read_list(env, str)))
-        return e;
+    struct symbol_cell* cell = malloc(sizeof(struct symbol_cell) + length + 1);
+    cell->value = NULL;
+    cell->hash = hash;
+    memcpy(cell->name, str, length);
+    cell->name[length] = '\0';
+    env->interned[slot] = cell->name;
+    env->interned_count++;
+    return cell->name;
+}
 
-    if ((e = read_quote(env, str)))
-        return e;
+// Free slots, see SLOT_SIZE
+static size_t available_heap_space(struct env* env)
+{
+    size_t slots = 0;
+    for (int c=0;c<SIZE_CLASSES;c++)
+        slots += (env->classes[c].free_count << class_shifts[c]) / SLOT_SIZE;
+    return slots;
+}
 
-    if ((e = read_boolean(str)))
-        return e;
+static size_t heap_slots(struct env* env)
+{
+    size_t slots = 0;
+    for (int c=0;c<SIZE_CLASSES;c++)
+        slots += (env->classes[c].blocks << class_shifts[c]) / SLOT_SIZE;
+    return slots;
+}
 
-    if ((e = read_symbol(env, str)))
-        return e;
+// Objects in the heap, counting dead ones in segments that aren't swept yet
+static size_t used_blocks(struct env* env)
+{
+    size_t blocks = 0;
+    for (int c=0;c<SIZE_CLASSES;c++)
+        blocks += env->classes[c].blocks - env->classes[c].free_count;
+    return blocks;
+}
 
-    return new_error(env, "Syntax error");
+static long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
-int as_integer(struct sexpr* e)
+static void record_pause(struct env* env, long long start_ns)
 {
-    if (e->tag == integer)
-        return e->integer;
-    else if (e->tag == boolean)
-        return e->boolean ? 1: 0;
-    else
-        return 0; // Error?
+    long long pause = now_ns() - start_ns;
+    if (pause > env->max_pause_ns)
+        env->max_pause_ns = pause;
 }
 
-bool as_bool(struct sexpr* e)
+static void push_gray(struct env* env, struct sexpr* sexpr)
 {
-    switch (e->tag)
+    if (env->gray_count == env->gray_capacity)
     {
-        case boolean:
-            return e->boolean;
-        case integer:
-            return e->integer != 0;
-        default:
-            return false;
+        env->gray_capacity = env->gray_capacity ? env->gray_capacity * 2 : 256;
+        env->gray = realloc(env->gray, sizeof(struct sexpr*) * env->gray_capacity);
     }
+    env->gray[env->gray_count++] = sexpr;
 }
 
-
-struct sexpr* eval_lambda(struct env* env, struct sexpr* args)
+// Must be called after storing a reference into an object that may have
+// been allocated before the current allocation, so that minor collections
+// find young objects that are only reachable from old ones and incremental
+// marking rescans objects it has already blackened
+static void write_barrier(struct env* env, struct sexpr* object)
 {
-    struct sexpr* params = args->list.head;
-    struct sexpr* body = args->list.tail;
+    if (!is_tracked(object))
+        return;
 
-    struct sexpr* sexpr = new_function(env, lambda);
-    sexpr->function.lambda.params = params;
-    sexpr->function.lambda.exprs = body;
+    struct segment* segment = segment_of(object);
+    size_t index = block_index(segment, object);
 
-    return sexpr;
+    if (env->gc_phase == gc_marking && test_bit(segment->mark_bits, index))
+        push_gray(env, object);
+
+    if (!test_bit(segment->old_bits, index) || test_bit(segment->remembered_bits, index))
+        return;
+
+    if (env->remembered_count == env->remembered_capacity)
+    {
+        env->remembered_capacity = env->remembered_capacity ? env->remembered_capacity * 2 : 64;
+        env->remembered = realloc(env->remembered, sizeof(struct sexpr*) * env->remembered_capacity);
+    }
+    set_bit(segment->remembered_bits, index);
+    env->remembered[env->remembered_count++] = object;
 }
 
-struct sexpr* eval_defun(struct env* env, struct sexpr* args)
+static void poison_block(struct segment* segment, struct sexpr* block)
 {
-    struct sexpr* s = args->list.head;
-
-    CHECK_ERROR(s);
+#ifdef YALP_GC_STRESS
+    memset(block, 0xa5, (size_t)1 << segment->block_shift); // Make use after free crash early
+#endif
+}
 
-    if (s->tag != symbol)
+static void sweep_segment(struct env* env, struct segment* segment)
+{
+    for (size_t w=0;w<SEGMENT_BITMAP_WORDS;w++)
     {
-        return new_error(env, "First argument to defun must be symbol");
+#ifdef YALP_GC_STRESS
+        uint64_t dead = segment->used_bits[w] & ~segment->mark_bits[w];
+        for (;dead;dead &= dead - 1)
+            poison_block(segment, block_at(segment, w * 64 + __builtin_ctzll(dead)));
+#endif
+        segment->used_bits[w] &= segment->mark_bits[w];
+        segment->mark_bits[w] = 0;
     }
 
-    struct sexpr* lambda = eval_lambda(env, args->list.tail);
+    segment->needs_sweep = false;
+    env->sweep_pending--;
+}
 
-    CHECK_ERROR(lambda);
+static void finish_sweeping(struct env* env)
+{
+    for (struct segment* segment = env->segments; segment && env->sweep_pending; segment = segment->next)
+    {
+        if (segment->needs_sweep)
+            sweep_segment(env, segment);
+    }
+}
 
-    add_env_binding(env, s->name, lambda);
+static void free_segment(struct segment* segment)
+{
+    if (segment->mapped)
+        munmap(segment, SEGMENT_SIZE);
+    else
+        free(segment);
+}
 
-    return lambda;
+static void init_segment(struct segment* segment, enum size_class size_class)
+{
+    // Only the header needs zeroing, blocks are cleared as they are allocated
+    memset(segment, 0, sizeof(struct segment));
+    segment->size_class = size_class;
+    segment->block_shift = class_shifts[size_class];
+    segment->block_count = class_blocks(size_class);
 }
 
-struct sexpr* eval_if(struct env* env, struct sexpr* args)
+// Adds segments for at least min_blocks more blocks of a class. Every
+// class may have one segment even when that exceeds the maximum heap size.
+static bool grow_heap(struct env* env, enum size_class size_class, size_t min_blocks)
 {
-    struct sexpr* cond = eval_argument(env, args, 0);
+    struct heap_class* heap_class = &env->classes[size_class];
+    size_t block_count = (size_t)(heap_class->blocks * (env->heap_config.growth_factor - 1.0));
+    if (block_count < min_blocks)
+        block_count = min_blocks;
+
+    size_t per_segment = class_blocks(size_class);
+    size_t segment_count = (block_count + per_segment - 1) / per_segment;
+    if (env->heap_config.max_slots)
+    {
+        size_t max_segments = env->heap_config.max_slots / SEGMENT_SLOTS;
+        if (heap_class->blocks == 0)
+            segment_count = 1;
+        else if (env->segment_count >= max_segments)
+            return false;
+        else if (env->segment_count + segment_count > max_segments)
+            segment_count = max_segments - env->segment_count;
+    }
 
-    size_t arg_count = list_length(args);
+    struct segment* first = NULL;
+    for (size_t i=0;i<segment_count;i++)
+    {
+        struct segment* segment = aligned_alloc(SEGMENT_SIZE, SEGMENT_SIZE);
+        if (!segment)
+            break;
+        init_segment(segment, size_class);
+
+        segment->next = env->segments;
+        env->segments = segment;
+        env->segment_count++;
+        heap_class->blocks += per_segment;
+        heap_class->free_count += per_segment;
+        first = segment;
+    }
 
-    if (as_bool(cond))
-        return eval_argument(env, args, 1);
-    else if (arg_count > 2)
-        return eval_argument(env, args, 2);
+    if (!first)
+        return false;
 
-    return NIL;
+    // Allocate from the fresh segments first
+    heap_class->alloc_segment = env->segments;
+    heap_class->alloc_word = 0;
+    heap_class->alloc_bits = 0;
+
+    return true;
 }
 
-struct sexpr* eval_reduce(struct env* env, struct sexpr* args)
+static void grow_heap_if_crowded(struct env* env)
 {
-    struct sexpr* fn = eval_type_argument(env, args, 0, function);
-    CHECK_ERROR(fn);
+    for (int c=0;c<SIZE_CLASSES;c++)
+    {
+        struct heap_class* heap_class = &env->classes[c];
+        size_t min_free = (size_t)(heap_class->blocks * (1.0 - 1.0 / env->heap_config.growth_factor));
+        if (heap_class->free_count < min_free || heap_class->free_count == 0)
+            grow_heap(env, c, 1);
+    }
+}
+
+// Takes the next free block of a class in address order, sweeping segments
+// as the cursor enters them. Must only be called when the class has free blocks.
+static struct sexpr* alloc_block(struct env* env, enum size_class size_class)
+{
+    struct heap_class* heap_class = &env->classes[size_class];
+    bool wrapped = false;
+    while (!heap_class->alloc_bits)
+    {
+        struct segment* segment = heap_class->alloc_segment;
+        if (!segment)
+        {
+            if (wrapped)
+                return NULL;
+            wrapped = true;
+            heap_class->alloc_segment = env->segments;
+            heap_class->alloc_word = 0;
+            continue;
+        }
+
+        if (segment->size_class != size_class || heap_class->alloc_word == bitmap_words(segment))
+        {
+            heap_class->alloc_segment = segment->next;
+            heap_class->alloc_word = 0;
+            continue;
+        }
+
+        if (heap_class->alloc_word == 0 && segment->needs_sweep)
+            sweep_segment(env, segment);
 
-    struct sexpr* lst = eval_type_argument(env, args, 1, list);
-    CHECK_ERROR(lst);
+        heap_class->alloc_bits = ~segment->used_bits[heap_class->alloc_word] & block_word_mask(segment, heap_class->alloc_word);
+        heap_class->alloc_word++;
+    }
 
-    struct sexpr* state = eval_argument(env, args, 2);
-    CHECK_ERROR(state);
+    struct segment* segment = heap_class->alloc_segment;
+    size_t index = (heap_class->alloc_word - 1) * 64 + __builtin_ctzll(heap_class->alloc_bits);
+    heap_class->alloc_bits &= heap_class->alloc_bits - 1;
 
-    struct sexpr* el;
-    while ((el = next(&lst)))
-        state = eval_sexpr(env, create_list(env, 3, fn, el, state));
+    set_bit(segment->used_bits, index);
+    clear_bit(segment->old_bits, index);
+    clear_bit(segment->remembered_bits, index);
+    heap_class->free_count--;
 
-    return state;
+    return block_at(segment, index);
 }
 
-struct sexpr* eval_bool_operator(struct env* env, struct sexpr* args, bool (*op) (struct sexpr*,struct sexpr*))
+static size_t collect_young(struct env* env);
+static size_t collect_garbage(struct env* env);
+static void start_gc_cycle(struct env* env);
+static void gc_step(struct env* env);
+
+static struct sexpr* alloc_sexpr(struct env* env, enum size_class size_class)
 {
-    int arg_length = list_length(args);
-    if (arg_length < 2)
-        return new_error(env, "At least 2 args are needed for binary operator");
-    bool result = true;
+#ifdef YALP_GC_STRESS
+    if (env->gc_phase != gc_idle)
+        gc_step(env);
+    else if (++env->stress_count % 16 == 0)
+        env->heap_config.pause_budget_us ? start_gc_cycle(env) : (void)collect_garbage(env);
+    else
+        collect_young(env);
+#endif
+    if (env->gc_phase != gc_idle)
+    {
+        if (++env->allocs_since_step >= INCREMENTAL_STEP_INTERVAL)
+            gc_step(env);
+    }
+    else if (env->nursery_count + env->external_bytes / SLOT_SIZE >= env->heap_config.nursery_blocks)
+    {
+        collect_young(env);
 
-    struct sexpr* left = next(&args);
-    struct sexpr* right;
-    while ((right = next(&args)))
+        if (env->heap_config.pause_budget_us &&
+            available_heap_space(env) < heap_slots(env) * INCREMENTAL_START_FREE_FRACTION)
+            start_gc_cycle(env);
+    }
+
+    // Rather grow than pause while an incremental collection is running
+    struct heap_class* heap_class = &env->classes[size_class];
+    if (heap_class->free_count == 0 && !(env->gc_phase != gc_idle && grow_heap(env, size_class, 1)))
     {
-        struct sexpr* eleft = eval_sexpr(env, left);
-        CHECK_ERROR(eleft);
+        collect_garbage(env);
+        grow_heap_if_crowded(env);
+    }
 
-        struct sexpr* eright = eval_sexpr(env, right);
-        CHECK_ERROR(eright);
+    struct sexpr* block = heap_class->free_count ? alloc_block(env, size_class) : NULL;
+    if (block)
+    {
+        memset(block, 0, (size_t)1 << class_shifts[size_class]);
 
-        result = result && op(eleft, eright);
+        if (env->nursery_count == env->nursery_capacity)
+        {
+            // Only happens while minor collections wait for an incremental one
+            env->nursery_capacity *= 2;
+            env->nursery = realloc(env->nursery, sizeof(struct sexpr*) * env->nursery_capacity);
+        }
+        env->nursery[env->nursery_count++] = block;
 
-        left = right;
+        if (env->gc_phase == gc_marking)
+        {
+            // Allocate gray, the fields are filled in after this returns
+            struct segment* segment = segment_of(block);
+            set_bit(segment->mark_bits, block_index(segment, block));
+            push_gray(env, block);
+        }
+
+        return block;
     }
 
-    return result ? S_TRUE: S_FALSE;
+    return MEMORY_ERROR;
 }
 
-bool equals(struct sexpr* left, struct sexpr* right)
+// Marks a white object, returns false if it is untracked, already marked
+// or old during a minor collection
+static bool mark_block(struct env* env, struct sexpr* sexpr)
 {
-    if (left == right)
-        return true;
-    return as_integer(left) == as_integer(right);
+    if (!is_tracked(sexpr))
+        return false;
+
+    struct segment* segment = segment_of(sexpr);
+    size_t index = block_index(segment, sexpr);
+    if (test_bit(segment->mark_bits, index))
+        return false;
+    // Minor collections treat old blocks as live and don't trace them,
+    // the remembered set covers their references to young blocks
+    if (env->collecting_young && test_bit(segment->old_bits, index))
+        return false;
+
+    set_bit(segment->mark_bits, index);
+    return true;
 }
 
-struct sexpr* eval_equals(struct env* env, struct sexpr* args)
+// Marks an object gray, its children are marked when it is popped from the gray stack
+static void mark_sexpr(struct env* env, struct sexpr* sexpr)
 {
-    return eval_bool_operator(env, args, equals);
+    if (mark_block(env, sexpr))
+        push_gray(env, sexpr);
 }
 
-bool less(struct sexpr* left, struct sexpr* right)
+// Marks the children of an object. A list tail that still needs scanning is
+// returned instead of pushed, so long lists are walked in a loop.
+static struct sexpr* mark_children(struct env* env, struct sexpr* sexpr)
 {
-    return as_integer(left) < as_integer(right);
+    switch (tag_of(sexpr))
+    {
+        case list:
+            mark_sexpr(env, sexpr->list.head);
+            return mark_block(env, sexpr->list.tail) ? sexpr->list.tail : NULL;
+        case function:
+            if (sexpr->function.tag == lambda)
+            {
+                mark_sexpr(env, sexpr->function.lambda.params);
+                mark_sexpr(env, sexpr->function.lambda.exprs);
+            }
+            break;
+        case vector:
+            if (sexpr->vector->type == object_vector)
+            {
+                for (size_t i=0;i<sexpr->vector->length;i++)
+                    mark_sexpr(env, sexpr->vector->items[i]);
+            }
+            break;
+        case hash:
+            for (size_t i=0;i<sexpr->table->capacity;i++)
+            {
+                mark_sexpr(env, sexpr->table->keys[i]);
+                mark_sexpr(env, sexpr->table->values[i]);
+            }
+            break;
+        case code:
+            for (size_t i=0;i<sexpr->code->constant_count;i++)
+                mark_sexpr(env, sexpr->code->constants[i]);
+            break;
+        default: // Atoms refer to nothing on the heap
+            break;
+    }
+
+    return NULL;
 }
 
-struct sexpr* eval_less(struct env* env, struct sexpr* args)
+// Scans up to max_objects gray objects, returns true when none are left
+static bool drain_gray(struct env* env, size_t max_objects)
 {
-    return eval_bool_operator(env, args, less);
+    while (env->gray_count > 0)
+    {
+        struct sexpr* sexpr = env->gray[--env->gray_count];
+        while (sexpr)
+        {
+            if (max_objects-- == 0)
+            {
+                push_gray(env, sexpr);
+                return false;
+            }
+            sexpr = mark_children(env, sexpr);
+        }
+    }
+
+    return true;
 }
 
-struct sexpr* eval_int_operator(struct env* env, struct sexpr* args, int (*op) (int,int), int state)
+static void mark_frame(struct env* env, struct frame* frame)
 {
-    struct sexpr* result = new_integer(env, state);
-    struct sexpr* arg;
-    while ((arg = next(&args)))
+    for (int i=0;i<frame->binding_count;i++)
     {
-        arg = eval_sexpr(env, arg);
-        CHECK_ERROR(arg);
-        result->integer = op(result->integer, as_integer(arg));
+        struct binding* binding = &frame->bindings[i];
+        if (binding->name && binding->value)
+        {
+            mark_sexpr(env, binding->value);
+        }
+        if (binding->name && binding->shadowed)
+            mark_sexpr(env, binding->shadowed);
     }
-
-    return result;
+    if (frame->context)
+        mark_sexpr(env, frame->context);
 }
 
-int add(int a, int b) {
-    return a + b;
+static void mark_roots(struct env* env)
+{
+    for (struct frame* frame = env->stack; frame; frame = frame->previous)
+        mark_frame(env, frame);
+
+    for (size_t i=0;i<env->value_count;i++)
+        mark_sexpr(env, env->values[i]);
+
+    for (struct compiler* compiler = env->compiler; compiler; compiler = compiler->previous)
+    {
+        for (size_t i=0;i<compiler->constant_count;i++)
+            mark_sexpr(env, compiler->constants[i]);
+    }
+
+    for (size_t i=0;i<env->root_count;i++)
+        mark_sexpr(env, *env->roots[i]);
+
+    for (struct reader* reader = env->reader; reader; reader = reader->previous)
+    {
+        for (size_t i=0;i<reader->depth;i++)
+        {
+            mark_sexpr(env, reader->open[i].head);
+            mark_sexpr(env, reader->open[i].last);
+        }
+        mark_sexpr(env, reader->form);
+    }
 }
 
-struct sexpr* eval_add(struct env* env, struct sexpr* args)
+// Frees the bytecode and vector storage of objects that marking didn't
+// reach. Must run before they are swept.
+static void sweep_external_objects(struct env* env)
 {
-    return eval_int_operator(env, args, add, 0);
+    size_t count = 0;
+    for (size_t i=0;i<env->external_object_count;i++)
+    {
+        struct sexpr* object = env->external_objects[i];
+        struct segment* segment = segment_of(object);
+        size_t index = block_index(segment, object);
+        if (test_bit(segment->mark_bits, index) ||
+            (env->collecting_young && test_bit(segment->old_bits, index)))
+            env->external_objects[count++] = object;
+        else
+            free_external(object);
+    }
+    env->external_object_count = count;
 }
 
-int subtract(int a, int b) {
-    return a - b;
+// Called once marking is complete. Counts live blocks, gives back empty
+// segments while the heap is larger than the growth policy asks for and
+// leaves the rest to be swept lazily.
+static void start_sweep(struct env* env)
+{
+    size_t live_blocks[SIZE_CLASSES] = {0};
+    for (struct segment* segment = env->segments; segment; segment = segment->next)
+    {
+        for (size_t w=0;w<SEGMENT_BITMAP_WORDS;w++)
+            live_blocks[segment->size_class] += __builtin_popcountll(segment->mark_bits[w]);
+    }
+
+    size_t target_blocks[SIZE_CLASSES];
+    for (int c=0;c<SIZE_CLASSES;c++)
+    {
+        target_blocks[c] = (size_t)(live_blocks[c] * env->heap_config.growth_factor);
+        size_t initial_blocks = env->heap_config.initial_slots * SLOT_SIZE >> class_shifts[c];
+        if (target_blocks[c] < initial_blocks)
+            target_blocks[c] = initial_blocks;
+    }
+
+    env->sweep_pending = 0;
+    struct segment** link = &env->segments;
+    while (*link)
+    {
+        struct segment* segment = *link;
+
+        bool empty = true;
+        for (size_t w=0;w<SEGMENT_BITMAP_WORDS && empty;w++)
+            empty = segment->mark_bits[w] == 0;
+
+        struct heap_class* heap_class = &env->classes[segment->size_class];
+        if (empty && heap_class->blocks - segment->block_count >= target_blocks[segment->size_class])
+        {
+            heap_class->blocks -= segment->block_count;
+            env->segment_count--;
+            *link = segment->next;
+            free_segment(segment);
+            continue;
+        }
+
+        segment->needs_sweep = true;
+        env->sweep_pending++;
+        link = &segment->next;
+    }
+
+    for (int c=0;c<SIZE_CLASSES;c++)
+    {
+        struct heap_class* heap_class = &env->classes[c];
+        heap_class->free_count = heap_class->blocks - live_blocks[c];
+        heap_class->alloc_segment = env->segments;
+        heap_class->alloc_word = 0;
+        heap_class->alloc_bits = 0;
+    }
+    env->sweep_segment = env->segments;
 }
 
-struct sexpr* eval_subtract(struct env* env, struct sexpr* args)
+static void finish_gc_cycle(struct env* env);
+
+// Full collection of both generations, returns the number of objects freed
+static size_t collect_garbage(struct env* env)
 {
-    if (args == NIL || args->list.tail == NIL)
-        return eval_int_operator(env, args, subtract, 0);
-    else
+    long long start = now_ns();
+    size_t used_before = used_blocks(env);
+
+    if (env->gc_phase != gc_idle)
     {
-        struct sexpr* first = eval_argument(env, args, 0);
-        CHECK_ERROR(first);
-        return eval_int_operator(env, args->list.tail, subtract, as_integer(first));
+        finish_gc_cycle(env);
+        record_pause(env, start);
+        return used_before - used_blocks(env);
     }
 
-    return eval_int_operator(env, args, subtract, 0);
+    finish_sweeping(env);
+    mark_roots(env);
+    drain_gray(env, SIZE_MAX);
+    sweep_external_objects(env);
+
+    // Every survivor is old now
+    for (struct segment* segment = env->segments; segment; segment = segment->next)
+    {
+        for (size_t w=0;w<SEGMENT_BITMAP_WORDS;w++)
+        {
+            segment->old_bits[w] |= segment->mark_bits[w];
+            segment->remembered_bits[w] = 0;
+        }
+    }
+    env->nursery_count = 0;
+    env->remembered_count = 0;
+
+    start_sweep(env);
+    env->full_collections++;
+
+    record_pause(env, start);
+    return used_before - used_blocks(env);
+}
+
+// Minor collection that only traces and sweeps blocks allocated since the
+// last collection and promotes the survivors, returns the number of objects freed
+static size_t collect_young(struct env* env)
+{
+    // The nursery belongs to the incremental collection until it is done
+    if (env->gc_phase != gc_idle)
+        return 0;
+
+    long long start = now_ns();
+    env->external_bytes = 0;
+
+    finish_sweeping(env);
+
+    env->collecting_young = true;
+    mark_roots(env);
+    for (size_t i=0;i<env->remembered_count;i++)
+    {
+        struct sexpr* object = env->remembered[i];
+        struct segment* segment = segment_of(object);
+        clear_bit(segment->remembered_bits, block_index(segment, object));
+
+        struct sexpr* tail = mark_children(env, object);
+        if (tail)
+            push_gray(env, tail);
+    }
+    env->remembered_count = 0;
+    drain_gray(env, SIZE_MAX);
+    sweep_external_objects(env);
+    env->collecting_young = false;
+
+    size_t freed = 0;
+    for (size_t i=0;i<env->nursery_count;i++)
+    {
+        struct sexpr* block = env->nursery[i];
+        struct segment* segment = segment_of(block);
+        size_t index = block_index(segment, block);
+        if (test_bit(segment->mark_bits, index))
+        {
+            clear_bit(segment->mark_bits, index);
+            set_bit(segment->old_bits, index);
+        }
+        else
+        {
+            clear_bit(segment->used_bits, index);
+            poison_block(segment, block);
+            env->classes[segment->size_class].free_count++;
+            freed++;
+        }
+    }
+    env->nursery_count = 0;
+
+    record_pause(env, start);
+    return freed;
+}
+
+// Incremental full collections mark and sweep the heap a slice at a time,
+// interleaved with allocation. Objects allocated during marking are gray
+// and write_barrier regrays black objects that are written to, so the
+// roots only need to be rescanned once when the gray stack first runs empty.
+// Minor collections are suspended meanwhile and everything allocated during
+// the cycle stays in the nursery.
+static void start_gc_cycle(struct env* env)
+{
+    // Promote everything first so the nursery only holds objects allocated
+    // during the cycle
+    collect_young(env);
+
+    long long start = now_ns();
+    env->gc_phase = gc_marking;
+    env->allocs_since_step = 0;
+    mark_roots(env);
+    record_pause(env, start);
+}
+
+static void end_gc_cycle(struct env* env)
+{
+    env->gc_phase = gc_idle;
+    env->full_collections++;
+    grow_heap_if_crowded(env);
+}
+
+static void finish_marking(struct env* env)
+{
+    mark_roots(env);
+    drain_gray(env, SIZE_MAX);
+    sweep_external_objects(env);
+
+    // Forget remembered blocks that are about to be swept
+    size_t count = 0;
+    for (size_t i=0;i<env->remembered_count;i++)
+    {
+        struct sexpr* object = env->remembered[i];
+        struct segment* segment = segment_of(object);
+        size_t index = block_index(segment, object);
+        if (test_bit(segment->mark_bits, index))
+            env->remembered[count++] = object;
+        else
+            clear_bit(segment->remembered_bits, index);
+    }
+    env->remembered_count = count;
+
+    // The allocator only hands out blocks from swept segments, so objects
+    // allocated from here on don't need to be marked
+    start_sweep(env);
+    env->gc_phase = gc_sweeping;
+}
+
+// Sweeps the next segment that the allocator hasn't swept yet, returns
+// true when the whole heap is swept
+static bool sweep_step(struct env* env)
+{
+    for (;env->sweep_segment;env->sweep_segment = env->sweep_segment->next)
+    {
+        if (env->sweep_segment->needs_sweep)
+        {
+            sweep_segment(env, env->sweep_segment);
+            break;
+        }
+    }
+
+    return env->sweep_pending == 0;
+}
+
+static void finish_gc_cycle(struct env* env)
+{
+    if (env->gc_phase == gc_marking)
+        finish_marking(env);
+
+    finish_sweeping(env);
+    end_gc_cycle(env);
+}
+
+static void gc_step(struct env* env)
+{
+    long long start = now_ns();
+    long long deadline = start + env->heap_config.pause_budget_us * 1000LL;
+    env->allocs_since_step = 0;
+
+    while (now_ns() < deadline)
+    {
+        if (env->gc_phase == gc_marking)
+        {
+            if (drain_gray(env, INCREMENTAL_WORK_CHUNK))
+                finish_marking(env);
+        }
+        else if (env->gc_phase == gc_sweeping)
+        {
+            if (sweep_step(env))
+                end_gc_cycle(env);
+        }
+        else
+            break;
+    }
+
+    record_pause(env, start);
+}
+
+// Longest time a single collection or collection step has paused the program
+static long long max_gc_pause_ns(struct env* env)
+{
+    return env->max_pause_ns;
+}
+
+// Destination of a compaction. It is allocated up front, big enough for
+// every block in use, and filled in copy order. Each class has its own
+// segments and scan position.
+struct to_space
+{
+    struct segment* first[SIZE_CLASSES];
+    struct segment* last[SIZE_CLASSES]; // Segment being filled
+    size_t last_count[SIZE_CLASSES];
+    size_t copied[SIZE_CLASSES];
+};
+
+static struct sexpr* to_space_alloc(struct to_space* to, enum size_class size_class)
+{
+    struct segment* last = to->last[size_class];
+    if (to->last_count[size_class] == last->block_count)
+    {
+        last = to->last[size_class] = last->next;
+        to->last_count[size_class] = 0;
+    }
+
+    size_t index = to->last_count[size_class]++;
+    set_bit(last->used_bits, index);
+    set_bit(last->old_bits, index);
+    to->copied[size_class]++;
+    return block_at(last, index);
+}
+
+// Copies an object to the to space unless that already happened and returns
+// the copy. The mark bit of a copied object is set and its head holds the
+// address of the copy. The rest of a list spine is copied right away, so
+// the cells of a list end up next to each other; their fields are fixed up
+// when the copies are scanned.
+static struct sexpr* evacuate(struct to_space* to, struct sexpr* sexpr)
+{
+    if (!is_tracked(sexpr))
+        return sexpr;
+
+    struct segment* segment = segment_of(sexpr);
+    if (test_bit(segment->mark_bits, block_index(segment, sexpr)))
+        return sexpr->list.head;
+
+    struct sexpr* first_copy = NULL;
+    while (is_tracked(sexpr))
+    {
+        segment = segment_of(sexpr);
+        size_t index = block_index(segment, sexpr);
+        if (test_bit(segment->mark_bits, index))
+            break;
+
+        struct sexpr* copy = to_space_alloc(to, segment->size_class);
+        memcpy(copy, sexpr, (size_t)1 << segment->block_shift);
+        set_bit(segment->mark_bits, index);
+        sexpr->list.head = copy;
+        if (!first_copy)
+            first_copy = copy;
+
+        if (segment->size_class != cons_class)
+            break;
+        sexpr = copy->list.tail;
+    }
+
+    return first_copy;
+}
+
+// Fixes up the fields of a copy
+static void scan_copy(struct to_space* to, struct sexpr* copy)
+{
+    switch (tag_of(copy))
+    {
+        case list:
+            copy->list.head = evacuate(to, copy->list.head);
+            copy->list.tail = evacuate(to, copy->list.tail);
+            break;
+        case function:
+            if (copy->function.tag == lambda)
+            {
+                copy->function.lambda.params = evacuate(to, copy->function.lambda.params);
+                copy->function.lambda.exprs = evacuate(to, copy->function.lambda.exprs);
+            }
+            break;
+        case vector:
+            if (copy->vector->type == object_vector)
+            {
+                for (size_t i=0;i<copy->vector->length;i++)
+                    copy->vector->items[i] = evacuate(to, copy->vector->items[i]);
+            }
+            break;
+        case hash:
+            // Keys are hashed by value, see hash_key, so moving them
+            // doesn't change where they belong
+            for (size_t i=0;i<copy->table->capacity;i++)
+            {
+                copy->table->keys[i] = evacuate(to, copy->table->keys[i]);
+                copy->table->values[i] = evacuate(to, copy->table->values[i]);
+            }
+            break;
+        case code:
+            for (size_t i=0;i<copy->code->constant_count;i++)
+                copy->code->constants[i] = evacuate(to, copy->code->constants[i]);
+            break;
+        default: // Atoms refer to nothing on the heap
+            break;
+    }
+}
+
+// Moves every live object into fresh segments in the order they are reached
+// from the roots, so that data structures are laid out contiguously. Objects
+// move, so this may only run when the frames and the shadow stack are the
+// only references into the heap, i.e. between top level forms.
+// Returns false when there is no memory for the copy.
+static bool compact_heap(struct env* env)
+{
+    long long start = now_ns();
+
+    if (env->gc_phase != gc_idle)
+        finish_gc_cycle(env);
+    // Mark bits become forwarding flags
+    finish_sweeping(env);
+
+    size_t segment_counts[SIZE_CLASSES];
+    size_t total_segments = 0;
+    for (int c=0;c<SIZE_CLASSES;c++)
+    {
+        size_t used = env->classes[c].blocks - env->classes[c].free_count;
+        segment_counts[c] = used / class_blocks(c) + 1;
+        total_segments += segment_counts[c];
+    }
+    if (env->heap_config.max_slots &&
+        (env->segment_count + total_segments) * SEGMENT_SLOTS > env->heap_config.max_slots)
+        return false;
+
+    struct to_space to = {0};
+    for (int c=0;c<SIZE_CLASSES;c++)
+    {
+        for (size_t i=0;i<segment_counts[c];i++)
+        {
+            struct segment* segment = aligned_alloc(SEGMENT_SIZE, SEGMENT_SIZE);
+            if (!segment)
+            {
+                for (c=0;c<SIZE_CLASSES;c++)
+                {
+                    for (segment = to.first[c]; segment; segment = to.first[c])
+                    {
+                        to.first[c] = segment->next;
+                        free(segment);
+                    }
+                }
+                return false;
+            }
+            init_segment(segment, c);
+            segment->next = to.first[c];
+            to.first[c] = segment;
+        }
+        to.last[c] = to.first[c];
+    }
+
+    for (struct frame* frame = env->stack; frame; frame = frame->previous)
+    {
+        for (int i=0;i<frame->binding_count;i++)
+        {
+            if (frame->bindings[i].name)
+            {
+                frame->bindings[i].value = evacuate(&to, frame->bindings[i].value);
+                frame->bindings[i].shadowed = evacuate(&to, frame->bindings[i].shadowed);
+            }
+        }
+        frame->context = evacuate(&to, frame->context);
+    }
+    for (size_t i=0;i<env->value_count;i++)
+        env->values[i] = evacuate(&to, env->values[i]);
+    for (size_t i=0;i<env->root_count;i++)
+        *env->roots[i] = evacuate(&to, *env->roots[i]);
+    for (struct reader* reader = env->reader; reader; reader = reader->previous)
+    {
+        for (size_t i=0;i<reader->depth;i++)
+        {
+            reader->open[i].head = evacuate(&to, reader->open[i].head);
+            reader->open[i].last = evacuate(&to, reader->open[i].last);
+        }
+        reader->form = evacuate(&to, reader->form);
+    }
+    // Symbol cells hold values of bindings, which were just moved
+    for (size_t i=0;i<env->interned_capacity;i++)
+    {
+        if (env->interned[i])
+            cell_of(env->interned[i])->value = evacuate(&to, cell_of(env->interned[i])->value);
+    }
+
+    // Cheney scan, copies are fixed up in order while more are appended,
+    // until no class has copies left to scan
+    struct segment* scan[SIZE_CLASSES];
+    size_t scan_index[SIZE_CLASSES] = {0};
+    for (int c=0;c<SIZE_CLASSES;c++)
+        scan[c] = to.first[c];
+    bool scanned = true;
+    while (scanned)
+    {
+        scanned = false;
+        for (int c=0;c<SIZE_CLASSES;c++)
+        {
+            while (scan[c] != to.last[c] || scan_index[c] < to.last_count[c])
+            {
+                if (scan_index[c] == scan[c]->block_count)
+                {
+                    scan[c] = scan[c]->next;
+                    scan_index[c] = 0;
+                    continue;
+                }
+                scan_copy(&to, block_at(scan[c], scan_index[c]++));
+                scanned = true;
+            }
+        }
+    }
+
+    // Code and vector objects that weren't copied are garbage
+    size_t external_object_count = 0;
+    for (size_t i=0;i<env->external_object_count;i++)
+    {
+        struct sexpr* object = env->external_objects[i];
+        struct segment* segment = segment_of(object);
+        if (test_bit(segment->mark_bits, block_index(segment, object)))
+            env->external_objects[external_object_count++] = object->list.head;
+        else
+            free_external(object);
+    }
+    env->external_object_count = external_object_count;
+
+    while (env->segments)
+    {
+        struct segment* segment = env->segments;
+        env->segments = segment->next;
+        free_segment(segment);
+    }
+
+    // Everything that was copied is old, the young generation is empty
+    struct segment** link = &env->segments;
+    for (int c=0;c<SIZE_CLASSES;c++)
+    {
+        *link = to.first[c];
+        while (*link)
+            link = &(*link)->next;
+
+        struct heap_class* heap_class = &env->classes[c];
+        heap_class->blocks = segment_counts[c] * class_blocks(c);
+        heap_class->free_count = heap_class->blocks - to.copied[c];
+        heap_class->alloc_segment = to.last[c];
+        heap_class->alloc_word = to.last_count[c] / 64;
+        heap_class->alloc_bits = 0;
+    }
+    env->segment_count = total_segments;
+    env->sweep_segment = NULL;
+    env->sweep_pending = 0;
+    env->nursery_count = 0;
+    env->remembered_count = 0;
+    env->compacted_collections = env->full_collections;
+
+    grow_heap_if_crowded(env);
+
+    record_pause(env, start);
+    return true;
+}
+
+// Compacts when the compact option is set and a full collection has left
+// holes in the heap since the last compaction
+static void compact_heap_if_fragmented(struct env* env)
+{
+    if (env->heap_config.compact && env->full_collections != env->compacted_collections)
+        compact_heap(env);
+}
+
+static struct sexpr* get_env_binding(struct env* env, const char* name)
+{
+    return get_binding(name);
+}
+
+static void add_env_binding(struct env* env, const char* name, struct sexpr* val)
+{
+    add_binding(env->stack, name, val);
+}
+
+static void add_env_builtin_function(struct env* env, const char* name, struct sexpr* (*fn) (struct env* env, struct sexpr*))
+{
+    struct sexpr* v = new_function(env, builtin);
+    if (v == MEMORY_ERROR)
+        return;
+    v->function.builtin.name = intern(env, name, strlen(name));
+    v->function.builtin.fn = fn;
+
+    add_env_binding(env, v->function.builtin.name, v);
+}
+
+static void push_stack_frame(struct env* env, struct sexpr* context, int binding_capacity)
+{
+    struct frame* frame = create_frame(&env->frame_arena, binding_capacity);
+    frame->previous = env->stack;
+    frame->context = context;
+    env->stack = frame;
+}
+
+static void pop_stack_frame(struct env* env)
+{
+    struct frame* new_top = env->stack->previous;
+    unbind_frame(env->stack);
+    free_frame(env->stack);
+    env->stack = new_top;
+}
+
+static struct sexpr* next(struct sexpr** list)
+{
+    if (*list == NIL)
+        return NULL;
+
+    struct sexpr* element = (*list)->list.head;
+    *list =(*list)->list.tail;
+    return element;
+}
+
+static int list_length(struct sexpr* list)
+{
+    int count = 0;
+    while (next(&list)) count++;
+    return count;
+}
+
+static bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static bool is_whitespace(char c)
+{
+    return c == ' ' || c == '\r' || c == '\n' || c == '\t';
+}
+
+static bool is_symbol_character(char c)
+{
+    return
+        (c >= 'a' && c <= 'z') ||
+        (c >= 'A' && c <= 'Z') ||
+        (c >= '0' && c <= '9') ||
+        (c == '_');
+}
+
+static bool is_operator(char c)
+{
+    switch(c)
+    {
+        case '+':
+        case '-':
+        case '*':
+        case '/':
+        case '=':
+        case '<':
+            return true;
+        default:
+            return false;
+    }
+}
+
+// The reader finds where runs of whitespace, digits and symbol characters
+// end from bit masks that classify the next 64 characters at once. With
+// AVX2 the masks are made 32 characters per instruction, without it or
+// close to the end of the input each character is tested by itself.
+enum character_class
+{
+    whitespace_class,
+    digit_class,
+    symbol_class
+};
+
+struct scan_window
+{
+    const char* start; // NULL until the first fill
+    // Bit i of each mask is set when start[i] is in that class
+    uint64_t masks[3];
+};
+
+#ifdef AVX2_KERNELS
+static bool use_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+// Bytes above 127 are negative, so they fall outside every range
+#define IN_RANGE(x, low, high) _mm256_and_si256( \
+    _mm256_cmpgt_epi8(x, _mm256_set1_epi8((low) - 1)), \
+    _mm256_cmpgt_epi8(_mm256_set1_epi8((high) + 1), x))
+
+static AVX2 void classify_avx2(const char* str, uint64_t masks[3])
+{
+    masks[0] = masks[1] = masks[2] = 0;
+    for (int half=0;half<2;half++)
+    {
+        __m256i chars = _mm256_loadu_si256((const __m256i*)(str + half * 32));
+        __m256i whitespace = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\n'))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\r')), _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\t'))));
+        __m256i digits = IN_RANGE(chars, '0', '9');
+        // Setting the 0x20 bit folds upper case letters onto lower case
+        __m256i letters = IN_RANGE(_mm256_or_si256(chars, _mm256_set1_epi8(0x20)), 'a', 'z');
+        __m256i symbols = _mm256_or_si256(_mm256_or_si256(digits, letters), _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('_')));
+
+        int shift = half * 32;
+        masks[whitespace_class] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(whitespace) << shift;
+        masks[digit_class] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(digits) << shift;
+        masks[symbol_class] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(symbols) << shift;
+    }
+}
+
+#undef IN_RANGE
+#endif
+
+// Classifies the 64 characters from str, false when it can't be done at once
+static bool fill_scan_window(struct scan_window* window, const char* str, const char* end)
+{
+#ifdef AVX2_KERNELS
+    if (end - str >= 64 && use_avx2())
+    {
+        classify_avx2(str, window->masks);
+        window->start = str;
+        return true;
+    }
+#endif
+    return false;
+}
+
+static bool in_class(char c, enum character_class class)
+{
+    switch (class)
+    {
+        case whitespace_class: return is_whitespace(c);
+        case digit_class: return is_digit(c);
+        default: return is_symbol_character(c);
+    }
+}
+
+// Returns the first character from str on that isn't in the class, or end
+static const char* span_class(struct scan_window* window, const char* str, const char* end, enum character_class class)
+{
+    while (true)
+    {
+        if (!window->start || str < window->start || str - window->start >= 64)
+        {
+            if (!fill_scan_window(window, str, end))
+                break;
+        }
+
+        // Ones are shifted in past the window so that a run reaching its
+        // end stops there and the window is filled again
+        size_t offset = str - window->start;
+        uint64_t outside = ~(window->masks[class] >> offset);
+        if (offset == 0 && !outside)
+        {
+            str += 64;
+            continue;
+        }
+        size_t length = __builtin_ctzll(outside);
+        str += length;
+        if (offset + length < 64)
+            return str;
+    }
+
+    while (str < end && in_class(*str, class))
+        str++;
+    return str;
+}
+
+static struct sexpr* create_list(struct env* env, int element_count, ...)
+{
+    size_t root_count = env->root_count;
+    struct sexpr* elements[element_count];
+    va_list valist;
+    va_start(valist, element_count);
+
+    for (int i=0;i<element_count;i++)
+    {
+        elements[i] = va_arg(valist, struct sexpr*);
+        push_root(env, &elements[i]);
+    }
+
+    va_end(valist);
+
+    struct sexpr* head = NIL;
+    struct sexpr* previous = NULL;
+    push_root(env, &head);
+
+    for (int i=0;i<element_count;i++)
+    {
+        struct sexpr* cell = new_sexpr(env, list);
+        if (cell == MEMORY_ERROR)
+        {
+            env->root_count = root_count;
+            return cell;
+        }
+        cell->list.head = elements[i];
+        cell->list.tail = NIL;
+        if (previous)
+        {
+            previous->list.tail = cell;
+            write_barrier(env, previous);
+        }
+        else
+            head = cell;
+
+        previous = cell;
+    }
+
+    env->root_count = root_count;
+
+    return head;
+}
+
+static void init_reader(struct env* env, struct reader* reader)
+{
+    memset(reader, 0, sizeof(struct reader));
+    reader->state = between_tokens;
+    reader->previous = env->reader;
+    env->reader = reader;
+}
+
+// Readers must be freed in the reverse order of init_reader
+static void free_reader(struct env* env, struct reader* reader)
+{
+    env->reader = reader->previous;
+    free(reader->token);
+    free(reader->open);
+}
+
+static void append_token(struct reader* reader, const char* str, size_t length)
+{
+    if (reader->token_length + length > reader->token_capacity)
+    {
+        if (!reader->token_capacity)
+            reader->token_capacity = 64;
+        while (reader->token_length + length > reader->token_capacity)
+            reader->token_capacity *= 2;
+        reader->token = realloc(reader->token, reader->token_capacity);
+    }
+    memcpy(reader->token + reader->token_length, str, length);
+    reader->token_length += length;
+}
+
+static void open_form(struct reader* reader, bool quote)
+{
+    if (reader->depth == reader->open_capacity)
+    {
+        reader->open_capacity = reader->open_capacity ? reader->open_capacity * 2 : 16;
+        reader->open = realloc(reader->open, sizeof(struct open_form) * reader->open_capacity);
+    }
+    reader->open[reader->depth++] = (struct open_form) {quote, NIL, NIL};
+}
+
+// Drops what was read so far and returns an error
+static struct sexpr* reader_error(struct env* env, struct reader* reader, const char* message)
+{
+    reader->depth = 0;
+    reader->token_length = 0;
+    reader->form = NULL;
+    reader->state = skipping_line;
+    return new_error(env, message);
+}
+
+// Makes the form of the token that was read
+static struct sexpr* finish_token(struct env* env, struct reader* reader)
+{
+    enum reader_state state = reader->state;
+    size_t length = reader->token_length;
+    reader->state = between_tokens;
+    reader->token_length = 0;
+
+    if (state == in_integer)
+        return new_integer(env, reader->number);
+    if (state == in_minus)
+        return new_symbol(env, "-", 1);
+    if (state == in_string)
+        return new_string(env, reader->token, length);
+    if (length == 4 && memcmp(reader->token, "true", 4) == 0)
+        return S_TRUE;
+    if (length == 5 && memcmp(reader->token, "false", 5) == 0)
+        return S_FALSE;
+    return new_symbol(env, reader->token, length);
+}
+
+// Adds the form in reader->form to the innermost open list, wrapping it
+// first for every quote it is in. Returns the form when it is at the top
+// level and NULL when it went into a list.
+static struct sexpr* add_form(struct env* env, struct reader* reader)
+{
+    while (reader->depth > 0 && reader->open[reader->depth - 1].quote)
+    {
+        struct sexpr* quoted = create_list(env, 2, new_symbol(env, "quote", 5), reader->form);
+        if (quoted == MEMORY_ERROR)
+            return reader_error(env, reader, error_message(quoted));
+        reader->form = quoted;
+        reader->depth--;
+    }
+
+    struct sexpr* form = reader->form;
+    if (reader->depth == 0)
+    {
+        reader->form = NULL;
+        return form;
+    }
+
+    struct sexpr* cell = new_sexpr(env, list);
+    if (cell == MEMORY_ERROR)
+        return reader_error(env, reader, error_message(cell));
+    struct open_form* open = &reader->open[reader->depth - 1];
+    cell->list.head = reader->form;
+    cell->list.tail = NIL;
+    if (open->last == NIL)
+        open->head = cell;
+    else
+    {
+        open->last->list.tail = cell;
+        write_barrier(env, open->last);
+    }
+    open->last = cell;
+    reader->form = NULL;
+    return NULL;
+}
+
+// Feeds the characters from *pos to end to the reader. Returns a top level
+// form as soon as it is complete, with *pos just after it, or NULL when
+// every character was used without completing one. eof tells that no more
+// input follows, so that a token at the end is finished and unclosed lists
+// are reported.
+static struct sexpr* read_chunk(struct env* env, struct reader* reader, const char** pos, const char* end, bool eof)
+{
+    struct scan_window window = {NULL};
+    while (*pos < end)
+    {
+        char c = **pos;
+        switch (reader->state)
+        {
+            case skipping_line:
+                if (c == '\n')
+                    reader->state = between_tokens;
+                (*pos)++;
+                continue;
+            case in_integer:
+            case in_symbol:
+            {
+                // Take the rest of the token in this chunk at once
+                const char* start = *pos;
+                if (reader->state == in_integer)
+                {
+                    *pos = span_class(&window, start, end, digit_class);
+                    intptr_t number = reader->number;
+                    bool negative = reader->negative;
+                    for (const char* digit = start;digit < *pos;digit++)
+                    {
+                        int value = *digit - '0';
+                        if (negative ? number < (INTEGER_MIN + value) / 10 : number > (INTEGER_MAX - value) / 10)
+                            return reader_error(env, reader, "Integer literal out of range");
+                        number = negative ? number * 10 - value : number * 10 + value;
+                    }
+                    reader->number = number;
+                }
+                else
+                {
+                    *pos = span_class(&window, start, end, symbol_class);
+                    append_token(reader, start, *pos - start);
+                }
+                if (*pos == end)
+                    continue;
+                reader->form = finish_token(env, reader);
+                break;
+            }
+            case in_string:
+                (*pos)++;
+                if (c == '"')
+                    reader->form = finish_token(env, reader);
+                else if (c == '\\')
+                    reader->state = in_string_escape;
+                else
+                    append_token(reader, &c, 1);
+                break;
+            case in_string_escape:
+                (*pos)++;
+                if (c != 'n' && c != 't' && c != '"' && c != '\\')
+                    return reader_error(env, reader, "Unknown escape in string");
+                c = c == 'n' ? '\n' : c == 't' ? '\t' : c;
+                append_token(reader, &c, 1);
+                reader->state = in_string;
+                break;
+            case in_minus:
+                // c isn't used up here, it is read again as the first digit
+                // or after the symbol -
+                if (is_digit(c))
+                {
+                    reader->state = in_integer;
+                    reader->number = 0;
+                    reader->negative = true;
+                    continue;
+                }
+                reader->state = between_tokens;
+                reader->form = new_symbol(env, "-", 1);
+                break;
+            case between_tokens:
+                (*pos)++;
+                if (is_whitespace(c))
+                {
+                    *pos = span_class(&window, *pos, end, whitespace_class);
+                    continue;
+                }
+                else if (c == '(')
+                    open_form(reader, false);
+                else if (c == ')')
+                {
+                    if (reader->depth == 0 || reader->open[reader->depth - 1].quote)
+                        return reader_error(env, reader, "Unbalanced parentheses");
+                    reader->form = reader->open[--reader->depth].head;
+                }
+                else if (c == '\'')
+                    open_form(reader, true);
+                else if (c == '"')
+                    reader->state = in_string;
+                else if (c == '-')
+                    reader->state = in_minus;
+                else if (is_operator(c))
+                    reader->form = new_symbol(env, &c, 1);
+                else if (is_symbol_character(c))
+                {
+                    // The token is taken from its first character on
+                    reader->state = is_digit(c) ? in_integer : in_symbol;
+                    reader->number = 0;
+                    reader->negative = false;
+                    (*pos)--;
+                }
+                else
+                    return reader_error(env, reader, "Syntax error");
+                break;
+        }
+
+        if (reader->form)
+        {
+            if (reader->form == MEMORY_ERROR)
+                return reader_error(env, reader, error_message(MEMORY_ERROR));
+            struct sexpr* form = add_form(env, reader);
+            if (form)
+                return form;
+        }
+    }
+
+    if (!eof)
+        return NULL;
+
+    if (reader->state == in_string || reader->state == in_string_escape)
+        return reader_error(env, reader, "Unterminated string");
+    if (reader->state == in_minus || reader->state == in_integer || reader->state == in_symbol)
+    {
+        reader->form = finish_token(env, reader);
+        if (reader->form == MEMORY_ERROR)
+            return reader_error(env, reader, error_message(MEMORY_ERROR));
+        struct sexpr* form = add_form(env, reader);
+        if (form)
+            return form;
+    }
+    reader->state = between_tokens;
+    if (reader->depth > 0)
+        return reader_error(env, reader, "Unbalanced parentheses");
+    return NULL;
+}
+
+// Where the reader gets its input from: a file descriptor that is read a
+// chunk at a time, or a string that is all there at once
+struct input
+{
+    int fd; // -1 for a string
+    char* buffer;
+    const char* pos;
+    const char* end;
+    bool eof;
+    size_t bytes_read; // From the file descriptor so far
+};
+
+#define INPUT_CHUNK_SIZE (64 * 1024)
+
+static void init_fd_input(struct input* input, int fd)
+{
+    input->fd = fd;
+    input->buffer = malloc(INPUT_CHUNK_SIZE);
+    input->pos = input->end = input->buffer;
+    input->eof = false;
+    input->bytes_read = 0;
+}
+
+static void init_string_input(struct input* input, const char* str)
+{
+    input->fd = -1;
+    input->buffer = NULL;
+    input->pos = str;
+    input->end = str + strlen(str);
+    input->eof = true;
+    input->bytes_read = 0;
+}
+
+static void free_input(struct input* input)
+{
+    free(input->buffer);
+}
+
+// Returns the next top level form, or NULL at the end of the input
+static struct sexpr* next_form(struct env* env, struct reader* reader, struct input* input)
+{
+    while (true)
+    {
+        struct sexpr* form = read_chunk(env, reader, &input->pos, input->end, input->eof);
+        if (form || input->eof)
+            return form;
+
+        // Prompts and output should be visible before blocking on input
+        fflush(stdout);
+        ssize_t count = read(input->fd, input->buffer, INPUT_CHUNK_SIZE);
+        if (count <= 0)
+            input->eof = true;
+        else
+            input->bytes_read += count;
+        input->pos = input->buffer;
+        input->end = input->buffer + (count > 0 ? count : 0);
+    }
+}
+
+static intptr_t as_integer(struct sexpr* e)
+{
+    if (tag_of(e) == integer)
+        return integer_value(e);
+    else if (e == S_TRUE)
+        return 1;
+    else
+        return 0; // Error?
+}
+
+static bool as_bool(struct sexpr* e)
+{
+    switch (tag_of(e))
+    {
+        case boolean:
+            return e == S_TRUE;
+        case integer:
+            return integer_value(e) != 0;
+        default:
+            return false;
+    }
+}
+
+
+// Whether params is a list of symbols, as the parameters of a lambda must be
+static bool is_param_list(struct sexpr* params)
+{
+    for (;tag_of(params) == list;params = params->list.tail)
+    {
+        if (tag_of(params->list.head) != symbol)
+            return false;
+    }
+    return params == NIL;
+}
+
+static struct sexpr* eval_lambda(struct env* env, struct sexpr* args)
+{
+    if (tag_of(args) != list)
+        return new_error(env, "lambda needs a parameter list");
+    if (!is_param_list(args->list.head))
+        return new_error(env, "Parameters must be a list of symbols");
+
+    struct sexpr* params = args->list.head;
+    struct sexpr* body = args->list.tail;
+
+    struct sexpr* sexpr = new_function(env, lambda);
+    if (sexpr == MEMORY_ERROR)
+        return sexpr;
+    sexpr->function.lambda.params = params;
+    sexpr->function.lambda.exprs = body;
+
+    return sexpr;
+}
+
+static struct sexpr* eval_defun(struct env* env, struct sexpr* args)
+{
+    if (tag_of(args) != list || tag_of(args->list.tail) != list)
+        return new_error(env, "defun needs a name and a parameter list");
+
+    struct sexpr* s = args->list.head;
+
+    CHECK_ERROR(s);
+
+    if (tag_of(s) != symbol)
+    {
+        return new_error(env, "First argument to defun must be symbol");
+    }
+
+    struct sexpr* lambda = eval_lambda(env, args->list.tail);
+
+    CHECK_ERROR(lambda);
+
+    add_env_binding(env, s->name, lambda);
+
+    return lambda;
+}
+
+static struct sexpr* eval_if(struct env* env, struct sexpr* args)
+{
+    struct sexpr* cond = eval_argument(env, args, 0);
+
+    size_t arg_count = list_length(args);
+
+    if (as_bool(cond))
+        return eval_argument(env, args, 1);
+    else if (arg_count > 2)
+        return eval_argument(env, args, 2);
+
+    return NIL;
+}
+
+static struct sexpr* eval_bool_operator(struct env* env, struct sexpr* args, bool (*op) (struct sexpr*,struct sexpr*))
+{
+    int arg_length = list_length(args);
+    if (arg_length < 2)
+        return new_error(env, "At least 2 args are needed for binary operator");
+    bool result = true;
+
+    struct sexpr* left = next(&args);
+    struct sexpr* right;
+    struct sexpr* eleft = NULL;
+    push_root(env, &eleft);
+    while ((right = next(&args)))
+    {
+        eleft = eval_sexpr(env, left);
+        CHECK_ERROR(eleft);
+
+        struct sexpr* eright = eval_sexpr(env, right);
+        CHECK_ERROR(eright);
+
+        result = result && op(eleft, eright);
+
+        left = right;
+    }
+
+    return result ? S_TRUE: S_FALSE;
+}
+
+static bool equals(struct sexpr* left, struct sexpr* right)
+{
+    if (left == right)
+        return true;
+    return as_integer(left) == as_integer(right);
+}
+
+static struct sexpr* eval_equals(struct env* env, struct sexpr* args)
+{
+    return eval_bool_operator(env, args, equals);
+}
+
+static bool less(struct sexpr* left, struct sexpr* right)
+{
+    return as_integer(left) < as_integer(right);
+}
+
+static struct sexpr* eval_less(struct env* env, struct sexpr* args)
+{
+    return eval_bool_operator(env, args, less);
+}
+
+// The error for an integer operator that failed with b as its right operand,
+// only division fails for a zero
+static struct sexpr* int_operator_error(struct env* env, intptr_t b)
+{
+    return new_error(env, b == 0 ? "Division by zero" : "Integer overflow");
+}
+
+static struct sexpr* eval_int_operator(struct env* env, struct sexpr* args, bool (*op) (intptr_t,intptr_t,intptr_t*), intptr_t state)
+{
+    struct sexpr* arg;
+    while ((arg = next(&args)))
+    {
+        arg = eval_sexpr(env, arg);
+        CHECK_ERROR(arg);
+        intptr_t value = as_integer(arg);
+        if (!op(state, value, &state))
+            return int_operator_error(env, value);
+    }
+
+    return new_integer(env, state);
+}
+
+static bool fits_integer(intptr_t n)
+{
+    return n >= INTEGER_MIN && n <= INTEGER_MAX;
+}
+
+// The integer operators store their result and return false if it doesn't
+// fit an integer
+static bool add(intptr_t a, intptr_t b, intptr_t* result) {
+    return !__builtin_add_overflow(a, b, result) && fits_integer(*result);
+}
+
+static struct sexpr* eval_add(struct env* env, struct sexpr* args)
+{
+    return eval_int_operator(env, args, add, 0);
+}
+
+static bool subtract(intptr_t a, intptr_t b, intptr_t* result) {
+    return !__builtin_sub_overflow(a, b, result) && fits_integer(*result);
+}
+
+static struct sexpr* eval_subtract(struct env* env, struct sexpr* args)
+{
+    if (args == NIL || args->list.tail == NIL)
+        return eval_int_operator(env, args, subtract, 0);
+    else
+    {
+        struct sexpr* first = eval_argument(env, args, 0);
+        CHECK_ERROR(first);
+        return eval_int_operator(env, args->list.tail, subtract, as_integer(first));
+    }
+
+    return eval_int_operator(env, args, subtract, 0);
+}
+
+static bool multiply(intptr_t a, intptr_t b, intptr_t* result) {
+    return !__builtin_mul_overflow(a, b, result) && fits_integer(*result);
+}
+
+static struct sexpr* eval_multiply(struct env* env, struct sexpr* args)
+{
+    return eval_int_operator(env, args, multiply, 1);
+}
+
+static bool divide(intptr_t a, intptr_t b, intptr_t* result) {
+    if (b == 0)
+        return false;
+    *result = a / b;
+    return fits_integer(*result);
+}
+
+static struct sexpr* eval_division(struct env* env, struct sexpr* args)
+{
+    if (args == NIL || args->list.tail == NIL)
+        return eval_int_operator(env, args, divide, 1);
+    else
+    {
+        struct sexpr* first = eval_argument(env, args, 0);
+        CHECK_ERROR(first);
+        return eval_int_operator(env, args->list.tail, divide, as_integer(first));
+    }
+}
+
+static struct sexpr* eval_quote(struct env* env, struct sexpr* args)
+{
+    if (tag_of(args) != list)
+        return new_error(env, "quote needs an argument");
+    return args->list.head; // Quote returns the unevaluated first argument
+}
+
+static struct sexpr* eval_list(struct env* env, struct sexpr* args)
+{
+    struct sexpr* head = NIL;
+    struct sexpr* previous = NULL;
+    push_root(env, &head);
+
+    struct sexpr* el;
+    while ((el = next(&args)))
+    {
+        struct sexpr* cell = new_sexpr(env, list);
+        if (cell == MEMORY_ERROR)
+            return cell;
+        cell->list.head = NIL;
+        cell->list.tail = NIL;
+        if (previous)
+        {
+            previous->list.tail = cell;
+            write_barrier(env, previous);
+        }
+        else
+            head = cell;
+        previous = cell;
+
+        cell->list.head = eval_sexpr(env, el);
+        write_barrier(env, cell);
+    }
+
+    return head;
+}
+
+static struct sexpr* eval_argument(struct env* env, struct sexpr* args, int n)
+{
+    while (n-- > 0)
+        next(&args);
+
+    if (args != NIL)
+        return eval_sexpr(env,args->list.head);
+    else
+        return NIL;
+}
+
+static struct sexpr* eval_type_argument(struct env* env, struct sexpr* args, int n, enum sexpr_t type)
+{
+    struct sexpr* arg = eval_argument(env, args, n);
+    CHECK_ERROR(arg);
+    if (tag_of(arg) != type)
+        return new_error(env, "Argument is of wrong type");
+    return arg;
+}
+
+
+static struct sexpr* eval_define(struct env* env, struct sexpr* args)
+{
+    if (tag_of(args) != list)
+        return new_error(env, "define needs a symbol and a value");
+
+    struct sexpr* sym = args->list.head;
+
+    CHECK_ERROR(sym);
+
+    if (tag_of(sym) != symbol)
+    {
+        return new_error(env, "Argument not evaluated to symbol");
+    }
+
+    struct sexpr* value = eval_argument(env, args, 1);
+
+    CHECK_ERROR(value);
+
+    add_env_binding(env, sym->name, value);
+
+    return value;
+}
+
+static struct sexpr* call_lambda(struct env* env, struct sexpr* lambda, struct sexpr* args)
+{
+    // Arguments are evaluated in the caller's frame and kept on the value
+    // stack, below them is the lambda so it stays reachable
+    size_t base = env->value_count;
+    reserve_values(env, 1);
+    env->values[env->value_count++] = lambda;
+
+    struct sexpr* arg;
+    int arg_count = 0;
+    while ((arg = next(&args)))
+    {
+        struct sexpr* value = eval_sexpr(env, arg);
+        reserve_values(env, 1);
+        env->values[env->value_count++] = value;
+        arg_count++;
+    }
+
+    struct sexpr* result = apply_lambda(env, lambda, base + 1, arg_count);
+    env->value_count = base;
+
+    return result;
+}
+
+
+static struct sexpr* eval_loop(struct env* env, struct sexpr* args)
+{
+    int arg_count = list_length(args);
+
+    if (arg_count < 3)
+        return new_error(env, "loop needs at least 3 arguments");
+
+    struct sexpr* params = next(&args);
+    if (!is_param_list(params))
+        return new_error(env, "Parameters must be a list of symbols");
+
+    struct sexpr* initial_args = next(&args);
+    if (initial_args != NIL && tag_of(initial_args) != list)
+        return new_error(env, "loop needs a list of initial arguments");
+
+    struct sexpr* body = args;
+
+    struct sexpr* l = new_function(env, lambda);
+    if (l == MEMORY_ERROR)
+        return l;
+
+    l->function.lambda.params = params;
+    l->function.lambda.exprs = body;
+
+    return call_lambda(env, l, initial_args);
+}
+
+static struct sexpr* eval_recur(struct env* env, struct sexpr* args)
+{
+    struct sexpr* lambda = env->stack->context;
+
+    if (!lambda)
+        return new_error(env, "recur can only be used inside of lambda");
+
+    return call_lambda(env, lambda, args);
+}
+
+static struct sexpr* eval_progn(struct env* env, struct sexpr* args)
+{
+    struct sexpr* result = NIL;
+
+    struct sexpr* arg;
+    while ((arg = next(&args)))
+    {
+        result = eval_sexpr(env, arg);
+    }
+
+    return result;
+}
+
+static struct sexpr* eval_form(struct env* env, struct sexpr* sexpr)
+{
+    // Only lists are evaluated
+    if (tag_of(sexpr) == list)
+    {
+        struct sexpr* value = eval_sexpr(env, sexpr->list.head);
+
+        if (tag_of(value) == function)
+        {
+            struct sexpr* args = sexpr->list.tail;
+            switch (value->function.tag)
+            {
+                case builtin:
+                    return value->function.builtin.fn(env, args);
+                case lambda:
+                    return call_lambda(env, value, args);
+            }
+        }
+        else if (value && tag_of(value) == error)
+            return value;
+        else
+        {
+            return new_error(env, "Non function value found when evaluating list");
+        }
+    }
+    else if (tag_of(sexpr) == symbol)
+    {
+        struct sexpr* value = get_env_binding(env, sexpr->name);
+        if (!value)
+            return unknown_symbol_error(env, sexpr->name);
+        else
+        {
+            return value;
+        }
+    }
+    else
+    {
+        return sexpr;
+    }
+}
+
+static struct sexpr* eval_sexpr(struct env* env, struct sexpr* sexpr)
+{
+    size_t root_count = env->root_count;
+    push_root(env, &sexpr);
+    struct sexpr* result = eval_form(env, sexpr);
+    env->root_count = root_count;
+    return result;
+}
+
+// Lambda bodies are compiled to bytecode the first time they are called and
+// top level forms before they are run. Calls to the core builtins compile to
+// opcodes behind a guard, as scope is dynamic and the name may be bound to
+// something else when the code runs. The guard falls back to an ordinary
+// call, which calls builtins with unevaluated arguments like eval_form does.
+enum opcode
+{
+    op_const, // constant: push it
+    op_load, // symbol constant: push its value
+    op_load_param, // slot: push the value of a parameter of the running lambda
+    op_pop,
+    op_jump, // target
+    op_jump_if_false, // target: pop a value and jump if it is false
+    op_define, // symbol constant: bind it to the top value
+    op_guard, // symbol constant, builtin constant, target: jump unless the
+              // symbol is bound to the builtin
+    op_prepare_call, // arguments constant, target: if the top value is a
+                     // builtin, replace it with the result of calling it
+                     // and jump, otherwise fall through to evaluate arguments
+    op_call, // argument count: call a lambda below the arguments
+    op_recur, // argument count: call the lambda of the current frame
+    op_tail_call, // argument count: like op_call but reuses the current frame
+    op_tail_recur, // argument count: like op_recur but reuses the current frame
+    op_add, // argument count
+    op_subtract, // argument count
+    op_multiply, // argument count
+    op_divide, // argument count
+    op_equals,
+    op_less,
+    op_list, // element count
+    op_return
+};
+
+static void emit(struct compiler* compiler, int op)
+{
+    if (compiler->op_count == compiler->op_capacity)
+    {
+        compiler->op_capacity = compiler->op_capacity ? compiler->op_capacity * 2 : 32;
+        compiler->ops = realloc(compiler->ops, sizeof(int) * compiler->op_capacity);
+    }
+    compiler->ops[compiler->op_count++] = op;
+}
+
+// Every use gets its own constant. Looking for an equal one made compiling
+// long literal lists quadratic and rarely found one, as the reader makes a
+// new symbol for each occurrence.
+static int add_constant(struct compiler* compiler, struct sexpr* constant)
+{
+    if (compiler->constant_count == compiler->constant_capacity)
+    {
+        compiler->constant_capacity = compiler->constant_capacity ? compiler->constant_capacity * 2 : 8;
+        compiler->constants = realloc(compiler->constants, sizeof(struct sexpr*) * compiler->constant_capacity);
+    }
+    compiler->constants[compiler->constant_count] = constant;
+    return (int)compiler->constant_count++;
+}
+
+// Tracks how many values the emitted code keeps on the value stack
+static void adjust_depth(struct compiler* compiler, int delta)
+{
+    compiler->depth += delta;
+    if (compiler->depth > compiler->max_depth)
+        compiler->max_depth = compiler->depth;
+}
+
+static void emit_constant(struct compiler* compiler, int op, struct sexpr* constant)
+{
+    emit(compiler, op);
+    emit(compiler, add_constant(compiler, constant));
+}
+
+// Emits a jump with a target that is filled in by patch_jump
+static size_t emit_jump(struct compiler* compiler, int op)
+{
+    emit(compiler, op);
+    emit(compiler, -1);
+    return compiler->op_count - 1;
+}
+
+static void patch_jump(struct compiler* compiler, size_t jump)
+{
+    compiler->ops[jump] = (int)compiler->op_count;
+}
+
+static int param_slot(struct sexpr* params, const char* name);
+
+// The builtin a list head is bound to at compile time, if any. Parameters
+// are bound anew on every call, so they never refer to a builtin here.
+static struct sexpr* builtin_of(struct env* env, struct compiler* compiler, struct sexpr* head)
+{
+    if (tag_of(head) != symbol || (compiler->params && param_slot(compiler->params, head->name) >= 0))
+        return NULL;
+
+    struct sexpr* value = get_env_binding(env, head->name);
+    if (!value || tag_of(value) != function || value->function.tag != builtin)
+        return NULL;
+
+    return value;
+}
+
+// Whether value is a builtin that calls the same function as expected
+static bool same_builtin(struct sexpr* value, struct sexpr* expected)
+{
+    return value == expected || (value && tag_of(value) == function && value->function.tag == builtin &&
+        value->function.builtin.fn == expected->function.builtin.fn);
+}
+
+static struct sexpr* new_lambda(struct env* env, struct sexpr* params, struct sexpr* exprs)
+{
+    struct sexpr* sexpr = new_function(env, lambda);
+    if (sexpr == MEMORY_ERROR)
+        return sexpr;
+    sexpr->function.lambda.params = params;
+    sexpr->function.lambda.exprs = exprs;
+    return sexpr;
+}
+
+static void compile_sexpr(struct env* env, struct compiler* compiler, struct sexpr* sexpr, bool tail);
+
+// Forms in tail position of a lambda body are compiled with tail set, calls
+// there replace the running lambda instead of returning to it
+static void compile_body(struct env* env, struct compiler* compiler, struct sexpr* body, bool tail)
+{
+    if (body == NIL)
+    {
+        emit_constant(compiler, op_const, NIL);
+        adjust_depth(compiler, 1);
+        return;
+    }
+
+    struct sexpr* expr;
+    while ((expr = next(&body)))
+    {
+        compile_sexpr(env, compiler, expr, tail && body == NIL);
+        if (body != NIL)
+        {
+            emit(compiler, op_pop);
+            adjust_depth(compiler, -1);
+        }
+    }
+}
+
+// Compiles argument n, or NIL if there aren't that many
+static void compile_argument(struct env* env, struct compiler* compiler, struct sexpr* args, int n, bool tail)
+{
+    while (n-- > 0)
+        next(&args);
+
+    if (args != NIL)
+        compile_sexpr(env, compiler, args->list.head, tail);
+    else
+    {
+        emit_constant(compiler, op_const, NIL);
+        adjust_depth(compiler, 1);
+    }
+}
+
+// Compiles every argument, returns how many there were
+static int compile_arguments(struct env* env, struct compiler* compiler, struct sexpr* args)
+{
+    int count = 0;
+    struct sexpr* arg;
+    while ((arg = next(&args)))
+    {
+        compile_sexpr(env, compiler, arg, false);
+        count++;
+    }
+    return count;
+}
+
+// Calls the value of head, whatever it is when the code runs
+static void compile_plain_call(struct env* env, struct compiler* compiler, struct sexpr* head, struct sexpr* args, bool tail)
+{
+    compile_sexpr(env, compiler, head, false);
+    emit_constant(compiler, op_prepare_call, args);
+    size_t end_jump = compiler->op_count;
+    emit(compiler, -1);
+    int count = compile_arguments(env, compiler, args);
+    emit(compiler, tail ? op_tail_call : op_call);
+    emit(compiler, count);
+    adjust_depth(compiler, -count);
+    patch_jump(compiler, end_jump);
+}
+
+// Whether a call to fn with args compiles to opcodes, see compile_builtin
+static bool has_opcodes(struct sexpr* (*fn) (struct env*, struct sexpr*), struct sexpr* args)
+{
+    int arg_count = list_length(args);
+    struct sexpr* first = args != NIL ? args->list.head : NIL;
+
+    if (fn == eval_quote || fn == eval_if)
+        return arg_count >= 1;
+    // Malformed lambdas are left to the builtins to report
+    if (fn == eval_lambda)
+        return arg_count >= 1 && is_param_list(first);
+    if (fn == eval_define)
+        return arg_count >= 1 && tag_of(first) == symbol;
+    if (fn == eval_defun)
+        return arg_count >= 2 && tag_of(first) == symbol && is_param_list(args->list.tail->list.head);
+    if (fn == eval_loop)
+        return arg_count >= 3 && is_param_list(first) &&
+            (tag_of(args->list.tail->list.head) == list || args->list.tail->list.head == NIL);
+    if (fn == eval_equals || fn == eval_less)
+        return arg_count == 2;
+    return fn == eval_progn || fn == eval_recur || fn == eval_add || fn == eval_subtract ||
+        fn == eval_multiply || fn == eval_division || fn == eval_list;
+}
+
+// Compiles a call to a builtin that has_opcodes says can be compiled
+static void compile_builtin(struct env* env, struct compiler* compiler, struct sexpr* (*fn) (struct env*, struct sexpr*),
+    struct sexpr* args, bool tail)
+{
+    int arg_count = list_length(args);
+    struct sexpr* first = args != NIL ? args->list.head : NIL;
+
+    if (fn == eval_quote)
+    {
+        emit_constant(compiler, op_const, first);
+        adjust_depth(compiler, 1);
+    }
+    else if (fn == eval_if)
+    {
+        compile_argument(env, compiler, args, 0, false);
+        size_t else_jump = emit_jump(compiler, op_jump_if_false);
+        adjust_depth(compiler, -1);
+
+        compile_argument(env, compiler, args, 1, tail);
+        size_t end_jump = emit_jump(compiler, op_jump);
+        adjust_depth(compiler, -1);
+
+        patch_jump(compiler, else_jump);
+        compile_argument(env, compiler, args, 2, tail);
+        patch_jump(compiler, end_jump);
+    }
+    else if (fn == eval_define)
+    {
+        compile_argument(env, compiler, args, 1, false);
+        emit_constant(compiler, op_define, first);
+    }
+    else if (fn == eval_lambda)
+    {
+        // Lambdas don't capture anything, so one object serves every evaluation
+        emit_constant(compiler, op_const, new_lambda(env, first, args->list.tail));
+        adjust_depth(compiler, 1);
+    }
+    else if (fn == eval_defun)
+    {
+        struct sexpr* rest = args->list.tail;
+        emit_constant(compiler, op_const, new_lambda(env, rest->list.head, rest->list.tail));
+        adjust_depth(compiler, 1);
+        emit_constant(compiler, op_define, first);
+    }
+    else if (fn == eval_progn)
+    {
+        compile_body(env, compiler, args, tail);
+    }
+    else if (fn == eval_loop)
+    {
+        struct sexpr* initial_args = args->list.tail->list.head;
+        emit_constant(compiler, op_const, new_lambda(env, first, args->list.tail->list.tail));
+        adjust_depth(compiler, 1);
+        int count = compile_arguments(env, compiler, initial_args);
+        emit(compiler, tail ? op_tail_call : op_call);
+        emit(compiler, count);
+        adjust_depth(compiler, -count);
+    }
+    else if (fn == eval_recur)
+    {
+        int count = compile_arguments(env, compiler, args);
+        emit(compiler, tail ? op_tail_recur : op_recur);
+        emit(compiler, count);
+        adjust_depth(compiler, 1 - count);
+    }
+    else if (fn == eval_add || fn == eval_subtract || fn == eval_multiply || fn == eval_division || fn == eval_list)
+    {
+        compile_arguments(env, compiler, args);
+        emit(compiler,
+            fn == eval_add ? op_add :
+            fn == eval_subtract ? op_subtract :
+            fn == eval_multiply ? op_multiply :
+            fn == eval_division ? op_divide : op_list);
+        emit(compiler, arg_count);
+        // op_list keeps the list it builds above the elements
+        adjust_depth(compiler, fn == eval_list ? 1 : 0);
+        adjust_depth(compiler, 1 - arg_count - (fn == eval_list ? 1 : 0));
+    }
+    else
+    {
+        compile_arguments(env, compiler, args);
+        emit(compiler, fn == eval_equals ? op_equals : op_less);
+        adjust_depth(compiler, -1);
+    }
+}
+
+static void compile_call(struct env* env, struct compiler* compiler, struct sexpr* sexpr, bool tail)
+{
+    struct sexpr* head = sexpr->list.head;
+    struct sexpr* args = sexpr->list.tail;
+    struct sexpr* builtin = builtin_of(env, compiler, head);
+    if (!builtin || !has_opcodes(builtin->function.builtin.fn, args))
+    {
+        compile_plain_call(env, compiler, head, args, tail);
+        return;
+    }
+
+    // Both ways leave one value on top of what was there
+    int depth = compiler->depth;
+    emit_constant(compiler, op_guard, head);
+    emit(compiler, add_constant(compiler, builtin));
+    size_t call_jump = compiler->op_count;
+    emit(compiler, -1);
+    compile_builtin(env, compiler, builtin->function.builtin.fn, args, tail);
+    size_t end_jump = emit_jump(compiler, op_jump);
+
+    compiler->depth = depth;
+    patch_jump(compiler, call_jump);
+    compile_plain_call(env, compiler, head, args, tail);
+    patch_jump(compiler, end_jump);
+}
+
+// Whether a parameter has the same name as one before it
+static bool is_repeated_param(struct sexpr* params, struct sexpr* param)
+{
+    for (;params->list.head != param;params = params->list.tail)
+    {
+        if (params->list.head->name == param->name)
+            return true;
+    }
+    return false;
+}
+
+// The slot bind_params puts a parameter in, or -1 if name isn't one
+static int param_slot(struct sexpr* params, const char* name)
+{
+    int slot = 0;
+    for (struct sexpr* rest = params;rest != NIL;rest = rest->list.tail)
+    {
+        if (rest->list.head->name == name)
+            return slot;
+        if (!is_repeated_param(params, rest->list.head))
+            slot++;
+    }
+    return -1;
+}
+
+static int count_param_slots(struct sexpr* params)
+{
+    int slots = 0;
+    for (struct sexpr* rest = params;rest != NIL;rest = rest->list.tail)
+    {
+        if (!is_repeated_param(params, rest->list.head))
+            slots++;
+    }
+    return slots;
+}
+
+static void compile_sexpr(struct env* env, struct compiler* compiler, struct sexpr* sexpr, bool tail)
+{
+    if (tag_of(sexpr) == list)
+        compile_call(env, compiler, sexpr, tail);
+    else
+    {
+        // Scope is dynamic, so only the parameters of the lambda itself can
+        // be resolved here. They are always in its own frame.
+        int slot = tag_of(sexpr) == symbol && compiler->params ? param_slot(compiler->params, sexpr->name) : -1;
+        if (slot >= 0)
+        {
+            emit(compiler, op_load_param);
+            emit(compiler, slot);
+        }
+        else
+            emit_constant(compiler, tag_of(sexpr) == symbol ? op_load : op_const, sexpr);
+        adjust_depth(compiler, 1);
+    }
+}
+
+// Compiles a sequence of forms into a code object, the body of lambda or
+// top level forms if it is NULL. Only lambda bodies have a frame of their
+// own that tail calls can reuse.
+static struct sexpr* compile_forms(struct env* env, struct sexpr* forms, struct sexpr* lambda)
+{
+    size_t root_count = env->root_count;
+    push_root(env, &forms);
+
+    struct compiler compiler = {0};
+    compiler.params = lambda ? lambda->function.lambda.params : NULL;
+    compiler.previous = env->compiler;
+    env->compiler = &compiler;
+
+    compile_body(env, &compiler, forms, lambda != NULL);
+    emit(&compiler, op_return);
+
+    struct sexpr* object = new_sexpr(env, code);
+    env->compiler = compiler.previous;
+    env->root_count = root_count;
+
+    if (tag_of(object) == error)
+    {
+        free(compiler.ops);
+        free(compiler.constants);
+        return object;
+    }
+
+    struct code* code = malloc(sizeof(struct code));
+    code->ops = compiler.ops;
+    code->op_count = compiler.op_count;
+    code->constants = compiler.constants;
+    code->constant_count = compiler.constant_count;
+    code->max_depth = compiler.max_depth;
+    code->param_slots = compiler.params ? count_param_slots(compiler.params) : 0;
+    object->code = code;
+
+    add_external_object(env, object);
+
+    return object;
+}
+
+// Returns the code object of a lambda, compiling its body the first time
+static struct sexpr* compile_lambda(struct env* env, struct sexpr* lambda)
+{
+    if (tag_of(lambda->function.lambda.exprs) == code)
+        return lambda->function.lambda.exprs;
+
+    size_t root_count = env->root_count;
+    push_root(env, &lambda);
+    struct sexpr* object = compile_forms(env, lambda->function.lambda.exprs, lambda);
+    env->root_count = root_count;
+    CHECK_ERROR(object);
+
+    lambda->function.lambda.exprs = object;
+    write_barrier(env, lambda);
+    return object;
+}
+
+// Binds parameters to the first slots of frame, in order and leaving out
+// repeated names, so that the code of the lambda can load them by slot
+static void bind_params(struct frame* frame, struct sexpr* params, struct sexpr** args, int arg_count)
+{
+    struct sexpr* param;
+    int slot = 0;
+    for (int pos=0;(param = next(&params));pos++)
+    {
+        if (bind_slot(frame, slot, param->name, pos < arg_count ? args[pos] : NIL))
+            slot++;
+    }
+}
+
+static struct sexpr* int_operator(struct env* env, struct sexpr** args, int arg_count, bool (*op) (intptr_t,intptr_t,intptr_t*), intptr_t state)
+{
+    for (int i=0;i<arg_count;i++)
+    {
+        CHECK_ERROR(args[i]);
+        intptr_t value = as_integer(args[i]);
+        if (!op(state, value, &state))
+            return int_operator_error(env, value);
+    }
+    return new_integer(env, state);
+}
+
+// Like int_operator, but with more than one argument the first one is the
+// initial state, as in eval_subtract and eval_division
+static struct sexpr* int_operator_from_first(struct env* env, struct sexpr** args, int arg_count, bool (*op) (intptr_t,intptr_t,intptr_t*), intptr_t state)
+{
+    if (arg_count < 2)
+        return int_operator(env, args, arg_count, op, state);
+
+    CHECK_ERROR(args[0]);
+    return int_operator(env, args + 1, arg_count - 1, op, as_integer(args[0]));
+}
+
+static struct sexpr* bool_operator(struct env* env, struct sexpr* left, struct sexpr* right, bool (*op) (struct sexpr*,struct sexpr*))
+{
+    CHECK_ERROR(left);
+    CHECK_ERROR(right);
+    return op(left, right) ? S_TRUE : S_FALSE;
+}
+
+// Makes a list of count values on the value stack at index values. The list
+// is built back to front in the slot above them.
+static struct sexpr* list_from_values(struct env* env, size_t values, int count)
+{
+    reserve_values(env, 1);
+    struct sexpr** slot = &env->values[env->value_count++];
+    *slot = NIL;
+    for (int i=count-1;i>=0;i--)
+    {
+        struct sexpr* cell = new_sexpr(env, list);
+        if (cell == MEMORY_ERROR)
+        {
+            *slot = cell;
+            break;
+        }
+        cell->list.head = env->values[values + i];
+        cell->list.tail = *slot;
+        *slot = cell;
+    }
+    env->value_count--;
+    return *slot;
+}
+
+// Runs bytecode with its values on top of the value stack. The stack pointer
+// is kept in a local and written back before anything that may allocate or
+// call, so the collector sees every value.
+static struct sexpr* run_code(struct env* env, struct code* code)
+{
+    size_t base = env->value_count;
+    reserve_values(env, code->max_depth);
+
+    struct sexpr** sp = env->values + base;
+    struct sexpr** constants = code->constants;
+    const int* ops = code->ops;
+    const int* ip = ops;
+    struct sexpr* result;
+    struct sexpr* callee;
+    int n, slots;
+
+#define SAVE_SP() (env->value_count = sp - env->values)
+#define LOAD_SP() (sp = env->values + env->value_count)
+
+#ifdef __GNUC__
+    static void* dispatch[] = {
+        &&do_op_const, &&do_op_load, &&do_op_load_param, &&do_op_pop, &&do_op_jump, &&do_op_jump_if_false,
+        &&do_op_define, &&do_op_guard, &&do_op_prepare_call, &&do_op_call, &&do_op_recur,
+        &&do_op_tail_call, &&do_op_tail_recur,
+        &&do_op_add, &&do_op_subtract, &&do_op_multiply, &&do_op_divide,
+        &&do_op_equals, &&do_op_less, &&do_op_list, &&do_op_return
+    };
+#define CASE(op) do_##op:
+#define NEXT() goto *dispatch[*ip++]
+    NEXT();
+#else
+#define CASE(op) case op:
+#define NEXT() continue
+    for (;;) switch (*ip++) {
+#endif
+
+    CASE(op_const)
+        *sp++ = constants[*ip++];
+        NEXT();
+
+    CASE(op_load)
+    {
+        struct sexpr* symbol = constants[*ip++];
+        struct sexpr* value = get_env_binding(env, symbol->name);
+        if (!value)
+        {
+            SAVE_SP();
+            value = unknown_symbol_error(env, symbol->name);
+        }
+        *sp++ = value;
+        NEXT();
+    }
+
+    CASE(op_load_param)
+        *sp++ = env->stack->bindings[*ip++].value;
+        NEXT();
+
+    CASE(op_pop)
+        sp--;
+        NEXT();
+
+    CASE(op_jump)
+        ip = ops + *ip;
+        NEXT();
+
+    CASE(op_jump_if_false)
+        n = *ip++;
+        if (!as_bool(*--sp))
+            ip = ops + n;
+        NEXT();
+
+    CASE(op_define)
+    {
+        struct sexpr* symbol = constants[*ip++];
+        if (sp[-1] && tag_of(sp[-1]) != error)
+            add_env_binding(env, symbol->name, sp[-1]);
+        NEXT();
+    }
+
+    CASE(op_guard)
+    {
+        struct sexpr* symbol = constants[*ip++];
+        struct sexpr* builtin = constants[*ip++];
+        n = *ip++;
+        if (!same_builtin(get_env_binding(env, symbol->name), builtin))
+            ip = ops + n;
+        NEXT();
+    }
+
+    CASE(op_prepare_call)
+    {
+        struct sexpr* args = constants[*ip++];
+        n = *ip++;
+        struct sexpr* callee = sp[-1];
+        if (tag_of(callee) == function && callee->function.tag == lambda)
+            NEXT();
+
+        SAVE_SP();
+        if (callee && tag_of(callee) == error)
+            result = callee;
+        else if (tag_of(callee) != function)
+            result = new_error(env, "Non function value found when evaluating list");
+        else
+        {
+            // Builtins push roots and leave it to eval_sexpr to drop them
+            size_t root_count = env->root_count;
+            result = callee->function.builtin.fn(env, args);
+            env->root_count = root_count;
+        }
+        LOAD_SP();
+        sp[-1] = result;
+        ip = ops + n;
+        NEXT();
+    }
+
+    CASE(op_call)
+        n = *ip++;
+        SAVE_SP();
+        result = apply_lambda(env, sp[-n - 1], sp - n - env->values, n);
+        LOAD_SP();
+        sp -= n;
+        sp[-1] = result;
+        NEXT();
+
+    CASE(op_recur)
+        n = *ip++;
+        SAVE_SP();
+        if (env->stack->context)
+            result = apply_lambda(env, env->stack->context, sp - n - env->values, n);
+        else
+            result = new_error(env, "recur can only be used inside of lambda");
+        LOAD_SP();
+        sp -= n;
+        *sp++ = result;
+        NEXT();
+
+    CASE(op_tail_call)
+        n = *ip++;
+        callee = sp[-n - 1];
+        slots = n + 1;
+        goto tail_call;
+
+    CASE(op_tail_recur)
+        n = *ip++;
+        callee = env->stack->context;
+        slots = n;
+        if (!callee)
+        {
+            SAVE_SP();
+            result = new_error(env, "recur can only be used inside of lambda");
+            sp -= n;
+            *sp++ = result;
+            NEXT();
+        }
+
+    tail_call:
+    {
+        // The callee takes over the frame of the running lambda. Its
+        // parameters are bound over the ones there, which it would shadow
+        // anyway, and it continues in this loop with the values reset.
+        SAVE_SP();
+        struct sexpr* object = compile_lambda(env, callee);
+        if (tag_of(object) == error)
+        {
+            sp -= slots;
+            *sp++ = object;
+            NEXT();
+        }
+
+        bind_params(env->stack, callee->function.lambda.params, sp - n, n);
+        env->stack->context = callee;
+
+        code = object->code;
+        constants = code->constants;
+        ops = code->ops;
+        ip = ops;
+        env->value_count = base;
+        reserve_values(env, code->max_depth);
+        sp = env->values + base;
+        NEXT();
+    }
+
+    CASE(op_add)
+        n = *ip++;
+        SAVE_SP();
+        result = int_operator(env, sp - n, n, add, 0);
+        sp -= n;
+        *sp++ = result;
+        NEXT();
+
+    CASE(op_subtract)
+        n = *ip++;
+        SAVE_SP();
+        result = int_operator_from_first(env, sp - n, n, subtract, 0);
+        sp -= n;
+        *sp++ = result;
+        NEXT();
+
+    CASE(op_multiply)
+        n = *ip++;
+        SAVE_SP();
+        result = int_operator(env, sp - n, n, multiply, 1);
+        sp -= n;
+        *sp++ = result;
+        NEXT();
+
+    CASE(op_divide)
+        n = *ip++;
+        SAVE_SP();
+        result = int_operator_from_first(env, sp - n, n, divide, 1);
+        sp -= n;
+        *sp++ = result;
+        NEXT();
+
+    CASE(op_equals)
+        sp--;
+        sp[-1] = bool_operator(env, sp[-1], sp[0], equals);
+        NEXT();
+
+    CASE(op_less)
+        sp--;
+        sp[-1] = bool_operator(env, sp[-1], sp[0], less);
+        NEXT();
+
+    CASE(op_list)
+        n = *ip++;
+        SAVE_SP();
+        result = list_from_values(env, sp - n - env->values, n);
+        LOAD_SP();
+        sp -= n;
+        *sp++ = result;
+        NEXT();
+
+    CASE(op_return)
+        result = sp[-1];
+        env->value_count = base;
+        return result;
+
+#ifndef __GNUC__
+    }
+#endif
+#undef CASE
+#undef NEXT
+#undef SAVE_SP
+#undef LOAD_SP
+}
+
+// Calls a lambda with arguments that are on the value stack at index args
+static struct sexpr* apply_lambda(struct env* env, struct sexpr* lambda, size_t args, int arg_count)
+{
+    struct sexpr* object = compile_lambda(env, lambda);
+    CHECK_ERROR(object);
+
+    push_stack_frame(env, lambda, object->code->param_slots);
+    bind_params(env->stack, lambda->function.lambda.params, env->values + args, arg_count);
+
+    struct sexpr* result = run_code(env, object->code);
+
+    // Popping stack frame also clears bindings
+    pop_stack_frame(env);
+
+    return result;
+}
+
+// Numeric kernels over int vectors. Arithmetic is done unsigned so that it
+// wraps instead of overflowing, the builtins check that results fit an
+// integer. Without AVX2 the scalar loops are left to
+// the compiler to vectorize.
+#ifdef AVX2_KERNELS
+static AVX2 int64_t int_sum_avx2(const int64_t* a, size_t n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (;i + 4 <= n;i += 4)
+        acc = _mm256_add_epi64(acc, _mm256_loadu_si256((const __m256i*)(a + i)));
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    uint64_t sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (;i < n;i++)
+        sum += (uint64_t)a[i];
+    return (int64_t)sum;
+}
+
+// op is '+' or '-'
+static AVX2 void int_elementwise_avx2(int64_t* dst, const int64_t* a, const int64_t* b, size_t n, char op)
+{
+    size_t i = 0;
+    for (;i + 4 <= n;i += 4)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+        __m256i r = op == '+' ? _mm256_add_epi64(x, y) : _mm256_sub_epi64(x, y);
+        _mm256_storeu_si256((__m256i*)(dst + i), r);
+    }
+    for (;i < n;i++)
+        dst[i] = (int64_t)(op == '+' ? (uint64_t)a[i] + (uint64_t)b[i] : (uint64_t)a[i] - (uint64_t)b[i]);
+}
+
+static AVX2 bool int_equal_avx2(const int64_t* a, const int64_t* b, size_t n)
+{
+    size_t i = 0;
+    for (;i + 4 <= n;i += 4)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(x, y)) != -1)
+            return false;
+    }
+    for (;i < n;i++)
+    {
+        if (a[i] != b[i])
+            return false;
+    }
+    return true;
+}
+#endif
+
+static int64_t int_sum(const int64_t* a, size_t n)
+{
+#ifdef AVX2_KERNELS
+    if (use_avx2())
+        return int_sum_avx2(a, n);
+#endif
+    uint64_t sum = 0;
+    for (size_t i=0;i<n;i++)
+        sum += (uint64_t)a[i];
+    return (int64_t)sum;
+}
+
+// AVX2 has no 64 bit multiply, emulating it was slower than these loops
+static int64_t int_product(const int64_t* a, size_t n)
+{
+    uint64_t product = 1;
+    for (size_t i=0;i<n;i++)
+        product *= (uint64_t)a[i];
+    return (int64_t)product;
+}
+
+static int64_t int_dot(const int64_t* a, const int64_t* b, size_t n)
+{
+    uint64_t sum = 0;
+    for (size_t i=0;i<n;i++)
+        sum += (uint64_t)a[i] * (uint64_t)b[i];
+    return (int64_t)sum;
+}
+
+static void int_elementwise(int64_t* dst, const int64_t* a, const int64_t* b, size_t n, char op)
+{
+#ifdef AVX2_KERNELS
+    if (use_avx2() && op != '*')
+    {
+        int_elementwise_avx2(dst, a, b, n, op);
+        return;
+    }
+#endif
+    for (size_t i=0;i<n;i++)
+    {
+        uint64_t x = (uint64_t)a[i], y = (uint64_t)b[i];
+        dst[i] = (int64_t)(op == '+' ? x + y : op == '-' ? x - y : x * y);
+    }
+}
+
+static bool int_equal(const int64_t* a, const int64_t* b, size_t n)
+{
+#ifdef AVX2_KERNELS
+    if (use_avx2())
+        return int_equal_avx2(a, b, n);
+#endif
+    for (size_t i=0;i<n;i++)
+    {
+        if (a[i] != b[i])
+            return false;
+    }
+    return true;
+}
+
+// Elements of object vectors start out as NIL, of int vectors as 0. Both
+// kinds of element take 8 bytes. Returns MEMORY_ERROR when the storage
+// can't be allocated or is more than --max-heap allows.
+static struct sexpr* new_vector(struct env* env, enum vector_t type, size_t length)
+{
+    if (length > SIZE_MAX / sizeof(int64_t) ||
+        (env->heap_config.max_slots && length > env->heap_config.max_slots / sizeof(int64_t) * SLOT_SIZE))
+        return MEMORY_ERROR;
+
+    struct vector* v = malloc(sizeof(struct vector));
+    if (!v)
+        return MEMORY_ERROR;
+    v->type = type;
+    v->length = length;
+    if (type == int_vector)
+        v->ints = calloc(length ? length : 1, sizeof(int64_t));
+    else
+    {
+        v->items = malloc(sizeof(struct sexpr*) * (length ? length : 1));
+        for (size_t i=0;v->items && i<length;i++)
+            v->items[i] = NIL;
+    }
+    if (!v->items)
+    {
+        free(v);
+        return MEMORY_ERROR;
+    }
+
+    // The storage is outside the heap, it counts towards the nursery so that
+    // garbage vectors are freed as often as they would be if they were in it
+    env->external_bytes += length * sizeof(int64_t);
+
+    struct sexpr* e = new_sexpr(env, vector);
+    if (e == MEMORY_ERROR)
+    {
+        free(v->items);
+        free(v);
+        return e;
+    }
+    e->vector = v;
+    add_external_object(env, e);
+    return e;
+}
+
+static struct sexpr* vector_element(struct env* env, struct vector* v, size_t index)
+{
+    if (v->type == int_vector)
+        return new_integer(env, (intptr_t)v->ints[index]);
+    return v->items[index];
+}
+
+// Calls a builtin with arguments that are already evaluated and on the value
+// stack at index args. The core builtins take them as they are, any other is
+// called like eval_form would with lists and symbols quoted.
+static struct sexpr* apply_builtin(struct env* env, struct sexpr* builtin, size_t args, int arg_count)
+{
+    struct sexpr* (*fn) (struct env*, struct sexpr*) = builtin->function.builtin.fn;
+    struct sexpr** values = env->values + args;
+
+    if (fn == eval_add)
+        return int_operator(env, values, arg_count, add, 0);
+    if (fn == eval_subtract)
+        return int_operator_from_first(env, values, arg_count, subtract, 0);
+    if (fn == eval_multiply)
+        return int_operator(env, values, arg_count, multiply, 1);
+    if (fn == eval_division)
+        return int_operator_from_first(env, values, arg_count, divide, 1);
+    if (fn == eval_equals && arg_count == 2)
+        return bool_operator(env, values[0], values[1], equals);
+    if (fn == eval_less && arg_count == 2)
+        return bool_operator(env, values[0], values[1], less);
+    if (fn == eval_list)
+        return list_from_values(env, args, arg_count);
+
+    size_t base = env->value_count;
+    reserve_values(env, arg_count);
+    for (int i=0;i<arg_count;i++)
+    {
+        struct sexpr* value = env->values[args + i];
+        enum sexpr_t tag = tag_of(value);
+        if (tag != list && tag != symbol)
+        {
+            env->values[env->value_count++] = value;
+            continue;
+        }
+
+        struct sexpr* quoted = create_list(env, 2, new_symbol(env, "quote", 5), value);
+        if (quoted == MEMORY_ERROR)
+        {
+            env->value_count = base;
+            return quoted;
+        }
+        env->values[env->value_count++] = quoted;
+    }
+    struct sexpr* quoted_args = list_from_values(env, base, arg_count);
+    env->value_count = base;
+    if (quoted_args == MEMORY_ERROR)
+        return quoted_args;
+
+    size_t root_count = env->root_count;
+    push_root(env, &quoted_args);
+    struct sexpr* result = fn(env, quoted_args);
+    env->root_count = root_count;
+    return result;
+}
+
+// Calls a function with arguments that are on the value stack at index args
+static struct sexpr* apply_function(struct env* env, struct sexpr* fn, size_t args, int arg_count)
+{
+    if (fn->function.tag == lambda)
+        return apply_lambda(env, fn, args, arg_count);
+    return apply_builtin(env, fn, args, arg_count);
+}
+
+// The sequence builtins below keep their state on the value stack: the
+// function, what is left of the list or the vector and then slots of their
+// own. Each element is passed to the function from a slot on top, so
+// calling it allocates nothing. Returns an error, or NULL with the slots
+// pushed.
+static struct sexpr* push_sequence_arguments(struct env* env, struct sexpr* args, int slots, bool vectors)
+{
+    size_t base = env->value_count;
+    reserve_values(env, 2 + slots);
+
+    struct sexpr* fn = eval_type_argument(env, args, 0, function);
+    CHECK_ERROR(fn);
+    env->values[env->value_count++] = fn;
+
+    struct sexpr* lst = eval_argument(env, args, 1);
+    if (!lst || tag_of(lst) == error || (lst != NIL && tag_of(lst) != list && !(vectors && tag_of(lst) == vector)))
+    {
+        env->value_count = base;
+        return lst && tag_of(lst) == error ? lst : new_error(env, "Argument is of wrong type");
+    }
+    env->values[env->value_count++] = lst;
+
+    for (int i=0;i<slots;i++)
+        env->values[env->value_count++] = NIL;
+
+    return NULL;
+}
+
+#define SEQUENCE_FN(base) env->values[(base)]
+#define SEQUENCE_LIST(base) env->values[(base) + 1]
+#define SEQUENCE_SLOT(base, n) env->values[(base) + 2 + (n)]
+
+// Takes the next element of the list or vector, position counts the elements
+// taken from a vector so far
+static struct sexpr* next_element(struct env* env, size_t base, size_t* position)
+{
+    struct sexpr* sequence = SEQUENCE_LIST(base);
+    if (tag_of(sequence) != vector)
+        return next(&SEQUENCE_LIST(base));
+    if (*position == sequence->vector->length)
+        return NULL;
+    return vector_element(env, sequence->vector, (*position)++);
+}
+
+// Appends the value in the slot at index value to the list whose first and
+// last cells are in the slots at index head and head + 1
+static struct sexpr* append_value(struct env* env, size_t head, size_t value)
+{
+    struct sexpr* cell = new_sexpr(env, list);
+    if (cell == MEMORY_ERROR)
+        return cell;
+    cell->list.head = env->values[value];
+    cell->list.tail = NIL;
+
+    struct sexpr* last = env->values[head + 1];
+    if (last == NIL)
+        env->values[head] = cell;
+    else
+    {
+        last->list.tail = cell;
+        write_barrier(env, last);
+    }
+    env->values[head + 1] = cell;
+    return cell;
+}
+
+// (map fn list) returns a list of fn applied to each element
+static struct sexpr* eval_map(struct env* env, struct sexpr* args)
+{
+    size_t base = env->value_count;
+    struct sexpr* result = push_sequence_arguments(env, args, 3, false);
+    if (result)
+        return result;
+
+    struct sexpr* el;
+    while ((el = next(&SEQUENCE_LIST(base))))
+    {
+        SEQUENCE_SLOT(base, 2) = el;
+        struct sexpr* value = apply_function(env, SEQUENCE_FN(base), base + 4, 1);
+        if (!value || tag_of(value) == error)
+        {
+            env->value_count = base;
+            return value;
+        }
+        SEQUENCE_SLOT(base, 2) = value;
+        if (append_value(env, base + 2, base + 4) == MEMORY_ERROR)
+        {
+            env->value_count = base;
+            return MEMORY_ERROR;
+        }
+    }
+
+    result = SEQUENCE_SLOT(base, 0);
+    env->value_count = base;
+    return result;
+}
+
+// (filter fn list) returns a list of the elements fn returns true for
+static struct sexpr* eval_filter(struct env* env, struct sexpr* args)
+{
+    size_t base = env->value_count;
+    struct sexpr* result = push_sequence_arguments(env, args, 3, false);
+    if (result)
+        return result;
+
+    struct sexpr* el;
+    while ((el = next(&SEQUENCE_LIST(base))))
+    {
+        SEQUENCE_SLOT(base, 2) = el;
+        struct sexpr* keep = apply_function(env, SEQUENCE_FN(base), base + 4, 1);
+        if (!keep || tag_of(keep) == error)
+        {
+            env->value_count = base;
+            return keep;
+        }
+        if (as_bool(keep) && append_value(env, base + 2, base + 4) == MEMORY_ERROR)
+        {
+            env->value_count = base;
+            return MEMORY_ERROR;
+        }
+    }
+
+    result = SEQUENCE_SLOT(base, 0);
+    env->value_count = base;
+    return result;
+}
+
+// (reduce fn list state) calls fn with each element and the state so far
+// and returns the last state. Reducing an int vector with + or * runs a
+// kernel instead.
+static struct sexpr* eval_reduce(struct env* env, struct sexpr* args)
+{
+    size_t base = env->value_count;
+    struct sexpr* result = push_sequence_arguments(env, args, 2, true);
+    if (result)
+        return result;
+
+    result = eval_argument(env, args, 2);
+    if (!result || tag_of(result) == error)
+    {
+        env->value_count = base;
+        return result;
+    }
+    SEQUENCE_SLOT(base, 1) = result;
+
+    struct sexpr* fn = SEQUENCE_FN(base);
+    struct sexpr* sequence = SEQUENCE_LIST(base);
+    if (tag_of(sequence) == vector && sequence->vector->type == int_vector && fn->function.tag == builtin)
+    {
+        struct vector* v = sequence->vector;
+        intptr_t total;
+        if (fn->function.builtin.fn == eval_add)
+        {
+            env->value_count = base;
+            if (!add(as_integer(result), (intptr_t)int_sum(v->ints, v->length), &total))
+                return new_error(env, "Integer overflow");
+            return new_integer(env, total);
+        }
+        if (fn->function.builtin.fn == eval_multiply)
+        {
+            env->value_count = base;
+            if (!multiply(as_integer(result), (intptr_t)int_product(v->ints, v->length), &total))
+                return new_error(env, "Integer overflow");
+            return new_integer(env, total);
+        }
+    }
+
+    struct sexpr* el;
+    size_t position = 0;
+    while ((el = next_element(env, base, &position)))
+    {
+        SEQUENCE_SLOT(base, 0) = el;
+        result = apply_function(env, SEQUENCE_FN(base), base + 2, 2);
+        if (!result || tag_of(result) == error)
+            break;
+        SEQUENCE_SLOT(base, 1) = result;
+    }
+
+    env->value_count = base;
+    return result;
+}
+
+// (for_each fn list) calls fn with each element for its side effects, list
+// may also be a vector
+static struct sexpr* eval_for_each(struct env* env, struct sexpr* args)
+{
+    size_t base = env->value_count;
+    struct sexpr* result = push_sequence_arguments(env, args, 1, true);
+    if (result)
+        return result;
+
+    struct sexpr* el;
+    size_t position = 0;
+    while ((el = next_element(env, base, &position)))
+    {
+        SEQUENCE_SLOT(base, 0) = el;
+        result = apply_function(env, SEQUENCE_FN(base), base + 2, 1);
+        if (!result || tag_of(result) == error)
+        {
+            env->value_count = base;
+            return result;
+        }
+    }
+
+    env->value_count = base;
+    return NIL;
+}
+
+#undef SEQUENCE_FN
+#undef SEQUENCE_LIST
+#undef SEQUENCE_SLOT
+
+// Evaluates the elements of a vector from the argument list. They are kept on
+// the value stack at base while the vector is allocated.
+static struct sexpr* eval_vector_arguments(struct env* env, struct sexpr* args, enum vector_t type)
+{
+    size_t base = env->value_count;
+    struct sexpr* arg;
+    while ((arg = next(&args)))
+    {
+        struct sexpr* value = eval_sexpr(env, arg);
+        if (!value || tag_of(value) == error || (type == int_vector && tag_of(value) != integer))
+        {
+            env->value_count = base;
+            return value && tag_of(value) == error ? value : new_error(env, "Argument is of wrong type");
+        }
+        reserve_values(env, 1);
+        env->values[env->value_count++] = value;
+    }
+
+    size_t length = env->value_count - base;
+    struct sexpr* v = new_vector(env, type, length);
+    if (v != MEMORY_ERROR)
+    {
+        for (size_t i=0;i<length;i++)
+        {
+            if (type == int_vector)
+                v->vector->ints[i] = integer_value(env->values[base + i]);
+            else
+                v->vector->items[i] = env->values[base + i];
+        }
+    }
+    env->value_count = base;
+    return v;
+}
+
+// (vector a b ...) makes a vector of any values
+static struct sexpr* eval_vector(struct env* env, struct sexpr* args)
+{
+    return eval_vector_arguments(env, args, object_vector);
+}
+
+// (int_vector a b ...) makes a vector of integers
+static struct sexpr* eval_int_vector(struct env* env, struct sexpr* args)
+{
+    return eval_vector_arguments(env, args, int_vector);
+}
+
+static struct sexpr* make_vector(struct env* env, struct sexpr* args, enum vector_t type)
+{
+    struct sexpr* length = eval_type_argument(env, args, 0, integer);
+    CHECK_ERROR(length);
+    if (integer_value(length) < 0)
+        return new_error(env, "Vector length is negative");
+
+    struct sexpr* fill = eval_argument(env, args, 1);
+    CHECK_ERROR(fill);
+    if (type == int_vector && fill != NIL && tag_of(fill) != integer)
+        return new_error(env, "Argument is of wrong type");
+
+    push_root(env, &fill);
+    struct sexpr* v = new_vector(env, type, (size_t)integer_value(length));
+    if (v == MEMORY_ERROR || fill == NIL)
+        return v;
+
+    for (size_t i=0;i<v->vector->length;i++)
+    {
+        if (type == int_vector)
+            v->vector->ints[i] = integer_value(fill);
+        else
+            v->vector->items[i] = fill;
+    }
+    return v;
+}
+
+// (make_vector length fill) makes a vector with every element set to fill,
+// or to NIL without it
+static struct sexpr* eval_make_vector(struct env* env, struct sexpr* args)
+{
+    return make_vector(env, args, object_vector);
+}
+
+// (make_int_vector length fill) is like make_vector, the fill defaults to 0
+static struct sexpr* eval_make_int_vector(struct env* env, struct sexpr* args)
+{
+    return make_vector(env, args, int_vector);
+}
+
+static struct sexpr* eval_vector_length(struct env* env, struct sexpr* args)
+{
+    struct sexpr* v = eval_type_argument(env, args, 0, vector);
+    CHECK_ERROR(v);
+    return new_integer(env, (intptr_t)v->vector->length);
+}
+
+// Evaluates a vector into v and an index into it, returns an error or NULL.
+// v is rooted, as the caller may allocate while it uses it.
+static struct sexpr* eval_vector_index(struct env* env, struct sexpr* args, struct sexpr** v, size_t* index)
+{
+    *v = eval_type_argument(env, args, 0, vector);
+    CHECK_ERROR(*v);
+    push_root(env, v);
+
+    struct sexpr* i = eval_type_argument(env, args, 1, integer);
+    CHECK_ERROR(i);
+    if (integer_value(i) < 0 || (size_t)integer_value(i) >= (*v)->vector->length)
+        return new_error(env, "Vector index out of range");
+
+    *index = (size_t)integer_value(i);
+    return NULL;
+}
+
+// (vector_ref v i) returns the element at index i
+static struct sexpr* eval_vector_ref(struct env* env, struct sexpr* args)
+{
+    size_t index;
+    struct sexpr* v = NULL;
+    struct sexpr* failed = eval_vector_index(env, args, &v, &index);
+    if (failed)
+        return failed;
+    return vector_element(env, v->vector, index);
+}
+
+// (vector_set v i value) sets the element at index i and returns value
+static struct sexpr* eval_vector_set(struct env* env, struct sexpr* args)
+{
+    size_t index;
+    struct sexpr* v = NULL;
+    struct sexpr* failed = eval_vector_index(env, args, &v, &index);
+    if (failed)
+        return failed;
+
+    struct sexpr* value = eval_argument(env, args, 2);
+    CHECK_ERROR(value);
+
+    if (v->vector->type == int_vector)
+    {
+        if (tag_of(value) != integer)
+            return new_error(env, "Argument is of wrong type");
+        v->vector->ints[index] = integer_value(value);
+    }
+    else
+    {
+        v->vector->items[index] = value;
+        write_barrier(env, v);
+    }
+    return value;
+}
+
+// (vector_sum v) adds up the elements
+static struct sexpr* eval_vector_sum(struct env* env, struct sexpr* args)
+{
+    struct sexpr* v = eval_type_argument(env, args, 0, vector);
+    CHECK_ERROR(v);
+
+    if (v->vector->type == int_vector)
+    {
+        intptr_t sum = (intptr_t)int_sum(v->vector->ints, v->vector->length);
+        if (!fits_integer(sum))
+            return new_error(env, "Integer overflow");
+        return new_integer(env, sum);
+    }
+
+    intptr_t sum = 0;
+    for (size_t i=0;i<v->vector->length;i++)
+    {
+        if (!add(sum, as_integer(v->vector->items[i]), &sum))
+            return new_error(env, "Integer overflow");
+    }
+    return new_integer(env, sum);
+}
+
+// Evaluates two vectors into left and right, returns an error or NULL
+static struct sexpr* eval_vector_pair(struct env* env, struct sexpr* args, struct sexpr** left, struct sexpr** right)
+{
+    *left = eval_type_argument(env, args, 0, vector);
+    CHECK_ERROR(*left);
+    push_root(env, left);
+
+    *right = eval_type_argument(env, args, 1, vector);
+    CHECK_ERROR(*right);
+    return NULL;
+}
+
+// (vector_dot a b) returns the dot product of two vectors
+static struct sexpr* eval_vector_dot(struct env* env, struct sexpr* args)
+{
+    struct sexpr* a = NULL;
+    struct sexpr* b = NULL;
+    struct sexpr* failed = eval_vector_pair(env, args, &a, &b);
+    if (failed)
+        return failed;
+    if (a->vector->length != b->vector->length)
+        return new_error(env, "Vectors differ in length");
+
+    if (a->vector->type == int_vector && b->vector->type == int_vector)
+    {
+        intptr_t sum = (intptr_t)int_dot(a->vector->ints, b->vector->ints, a->vector->length);
+        if (!fits_integer(sum))
+            return new_error(env, "Integer overflow");
+        return new_integer(env, sum);
+    }
+
+    intptr_t sum = 0;
+    for (size_t i=0;i<a->vector->length;i++)
+    {
+        intptr_t product;
+        if (!multiply(as_integer(vector_element(env, a->vector, i)), as_integer(vector_element(env, b->vector, i)), &product) ||
+            !add(sum, product, &sum))
+            return new_error(env, "Integer overflow");
+    }
+    return new_integer(env, sum);
+}
+
+// (vector_equal a b) returns whether two vectors have equal elements
+static struct sexpr* eval_vector_equal(struct env* env, struct sexpr* args)
+{
+    struct sexpr* a = NULL;
+    struct sexpr* b = NULL;
+    struct sexpr* failed = eval_vector_pair(env, args, &a, &b);
+    if (failed)
+        return failed;
+    if (a->vector->length != b->vector->length)
+        return S_FALSE;
+
+    if (a->vector->type == int_vector && b->vector->type == int_vector)
+        return int_equal(a->vector->ints, b->vector->ints, a->vector->length) ? S_TRUE : S_FALSE;
+
+    for (size_t i=0;i<a->vector->length;i++)
+    {
+        if (!equals(vector_element(env, a->vector, i), vector_element(env, b->vector, i)))
+            return S_FALSE;
+    }
+    return S_TRUE;
+}
+
+// (vector_map fn a b ...) returns a vector of fn applied to the elements of
+// the vectors at each index. +, - and * over two int vectors run a kernel.
+static struct sexpr* eval_vector_map(struct env* env, struct sexpr* args)
+{
+    size_t base = env->value_count;
+    int count = list_length(args) - 1;
+    if (count < 1)
+        return new_error(env, "vector_map needs a function and a vector");
+
+    // The function, the vectors, the result and then the arguments of a call
+    reserve_values(env, 2 + 2 * count);
+    for (int i=0;i<=count;i++)
+    {
+        struct sexpr* arg = eval_type_argument(env, args, i, i == 0 ? function : vector);
+        if (!arg || tag_of(arg) == error)
+        {
+            env->value_count = base;
+            return arg;
+        }
+        if (i > 1 && arg->vector->length != env->values[base + 1]->vector->length)
+        {
+            env->value_count = base;
+            return new_error(env, "Vectors differ in length");
+        }
+        env->values[env->value_count++] = arg;
+    }
+
+    struct sexpr* fn = env->values[base];
+    struct sexpr* a = env->values[base + 1];
+    size_t length = a->vector->length;
+    char op = 0;
+    if (fn->function.tag == builtin && count == 2 &&
+        a->vector->type == int_vector && env->values[base + 2]->vector->type == int_vector)
+    {
+        struct sexpr* (*builtin_fn) (struct env*, struct sexpr*) = fn->function.builtin.fn;
+        op = builtin_fn == eval_add ? '+' : builtin_fn == eval_subtract ? '-' : builtin_fn == eval_multiply ? '*' : 0;
+    }
+
+    struct sexpr* result = new_vector(env, op ? int_vector : object_vector, length);
+    if (result == MEMORY_ERROR || op)
+    {
+        if (result != MEMORY_ERROR)
+            int_elementwise(result->vector->ints, env->values[base + 1]->vector->ints,
+                env->values[base + 2]->vector->ints, length, op);
+        env->value_count = base;
+        return result;
+    }
+    env->values[env->value_count++] = result;
+
+    size_t call_args = env->value_count;
+    env->value_count += count;
+    for (size_t i=0;i<length;i++)
+    {
+        for (int j=0;j<count;j++)
+            env->values[call_args + j] = vector_element(env, env->values[base + 1 + j]->vector, i);
+
+        struct sexpr* value = apply_function(env, env->values[base], call_args, count);
+        if (!value || tag_of(value) == error)
+        {
+            env->value_count = base;
+            return value;
+        }
+        result = env->values[call_args - 1];
+        result->vector->items[i] = value;
+        write_barrier(env, result);
+    }
+
+    result = env->values[call_args - 1];
+    env->value_count = base;
+    return result;
+}
+
+// Hash tables hash keys by value: integers, booleans and NIL by their
+// encoding, symbols and strings by their text and lists by their elements.
+// Anything else is compared by identity but hashed by its tag alone, so
+// that compaction moving it doesn't change where it belongs.
+static uint64_t hash_key(struct sexpr* key)
+{
+    uint64_t hash = 0;
+    while (tag_of(key) == list)
+    {
+        hash = (hash ^ hash_key(key->list.head)) * 0x100000001b3ULL;
+        key = key->list.tail;
+    }
+
+    uint64_t h;
+    switch (tag_of(key))
+    {
+        case symbol:
+            h = cell_of(key->name)->hash;
+            break;
+        case string:
+            h = hash_string(key->text, strlen(key->text));
+            break;
+        case integer:
+        case boolean:
+        case nil:
+            h = (uint64_t)(uintptr_t)key;
+            break;
+        default:
+            h = tag_of(key);
+            break;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (hash ^ h) * 0x100000001b3ULL;
+}
+
+static bool keys_equal(struct sexpr* a, struct sexpr* b)
+{
+    while (a != b)
+    {
+        if (tag_of(a) != tag_of(b))
+            return false;
+        if (tag_of(a) == symbol)
+            return a->name == b->name;
+        if (tag_of(a) == string)
+            return strcmp(a->text, b->text) == 0;
+        if (tag_of(a) != list || !keys_equal(a->list.head, b->list.head))
+            return false;
+        a = a->list.tail;
+        b = b->list.tail;
+    }
+    return true;
+}
+
+// The slot of key, or of the first free slot on its probe sequence when it
+// isn't in the table
+static size_t hash_slot(struct hash_table* table, struct sexpr* key)
+{
+    size_t mask = table->capacity - 1;
+    size_t free_slot = SIZE_MAX;
+    for (size_t i = hash_key(key) & mask;;i = (i + 1) & mask)
+    {
+        struct sexpr* k = table->keys[i];
+        if (!k)
+            return free_slot != SIZE_MAX ? free_slot : i;
+        if (k == HASH_REMOVED)
+        {
+            if (free_slot == SIZE_MAX)
+                free_slot = i;
+        }
+        else if (keys_equal(k, key))
+            return i;
+    }
+}
+
+static void resize_hash_table(struct env* env, struct hash_table* table, size_t capacity)
+{
+    struct sexpr** keys = table->keys;
+    struct sexpr** values = table->values;
+    size_t old_capacity = table->capacity;
+
+    table->capacity = capacity;
+    table->used = table->count;
+    table->keys = calloc(capacity, sizeof(struct sexpr*));
+    table->values = calloc(capacity, sizeof(struct sexpr*));
+    env->external_bytes += capacity * 2 * sizeof(struct sexpr*);
+
+    for (size_t i=0;i<old_capacity;i++)
+    {
+        if (keys[i] && keys[i] != HASH_REMOVED)
+        {
+            size_t slot = hash_slot(table, keys[i]);
+            table->keys[slot] = keys[i];
+            table->values[slot] = values[i];
+        }
+    }
+    free(keys);
+    free(values);
+}
+
+static struct sexpr* new_hash_table(struct env* env)
+{
+    struct sexpr* e = new_sexpr(env, hash);
+    if (e == MEMORY_ERROR)
+        return e;
+
+    struct hash_table* table = calloc(1, sizeof(struct hash_table));
+    resize_hash_table(env, table, 8);
+    e->table = table;
+    add_external_object(env, e);
+    return e;
+}
+
+// (make_hash) makes an empty hash table
+static struct sexpr* eval_make_hash(struct env* env, struct sexpr* args)
+{
+    return new_hash_table(env);
+}
+
+// Evaluates a hash table and a key into it
+static struct sexpr* eval_hash_key(struct env* env, struct sexpr* args, struct sexpr** table, struct sexpr** key)
+{
+    *table = eval_type_argument(env, args, 0, hash);
+    CHECK_ERROR(*table);
+    push_root(env, table);
+
+    *key = eval_argument(env, args, 1);
+    CHECK_ERROR(*key);
+    push_root(env, key);
+    return NULL;
+}
+
+// (hash_get table key default) returns the value of key, or default when
+// the key isn't in the table
+static struct sexpr* eval_hash_get(struct env* env, struct sexpr* args)
+{
+    struct sexpr* table = NULL;
+    struct sexpr* key = NULL;
+    struct sexpr* failed = eval_hash_key(env, args, &table, &key);
+    if (failed)
+        return failed;
+
+    size_t slot = hash_slot(table->table, key);
+    if (table->table->keys[slot] && table->table->keys[slot] != HASH_REMOVED)
+        return table->table->values[slot];
+    return eval_argument(env, args, 2);
+}
+
+// (hash_set table key value) sets the value of key and returns value
+static struct sexpr* eval_hash_set(struct env* env, struct sexpr* args)
+{
+    struct sexpr* table = NULL;
+    struct sexpr* key = NULL;
+    struct sexpr* failed = eval_hash_key(env, args, &table, &key);
+    if (failed)
+        return failed;
+
+    struct sexpr* value = eval_argument(env, args, 2);
+    CHECK_ERROR(value);
+
+    struct hash_table* t = table->table;
+    size_t slot = hash_slot(t, key);
+    if (!t->keys[slot] || t->keys[slot] == HASH_REMOVED)
+    {
+        if (!t->keys[slot])
+            t->used++;
+        t->count++;
+        t->keys[slot] = key;
+        // Keep at least a quarter of the slots free so probes stay short
+        if (t->used * 4 > t->capacity * 3)
+        {
+            resize_hash_table(env, t, t->count * 4 > t->capacity ? t->capacity * 2 : t->capacity);
+            slot = hash_slot(t, key);
+        }
+    }
+    t->values[slot] = value;
+    write_barrier(env, table);
+    return value;
+}
+
+// (hash_remove table key) removes key and returns whether it was there
+static struct sexpr* eval_hash_remove(struct env* env, struct sexpr* args)
+{
+    struct sexpr* table = NULL;
+    struct sexpr* key = NULL;
+    struct sexpr* failed = eval_hash_key(env, args, &table, &key);
+    if (failed)
+        return failed;
+
+    struct hash_table* t = table->table;
+    size_t slot = hash_slot(t, key);
+    if (!t->keys[slot] || t->keys[slot] == HASH_REMOVED)
+        return S_FALSE;
+
+    t->keys[slot] = HASH_REMOVED;
+    t->values[slot] = NULL;
+    t->count--;
+    return S_TRUE;
+}
+
+// (hash_count table) returns the number of entries
+static struct sexpr* eval_hash_count(struct env* env, struct sexpr* args)
+{
+    struct sexpr* table = eval_type_argument(env, args, 0, hash);
+    CHECK_ERROR(table);
+    return new_integer(env, (intptr_t)table->table->count);
+}
+
+// (hash_keys table) returns a list of the keys
+static struct sexpr* eval_hash_keys(struct env* env, struct sexpr* args)
+{
+    struct sexpr* table = eval_type_argument(env, args, 0, hash);
+    CHECK_ERROR(table);
+
+    size_t base = env->value_count;
+    reserve_values(env, table->table->count);
+    for (size_t i=0;i<table->table->capacity;i++)
+    {
+        if (table->table->keys[i] && table->table->keys[i] != HASH_REMOVED)
+            env->values[env->value_count++] = table->table->keys[i];
+    }
+    struct sexpr* keys = list_from_values(env, base, (int)(env->value_count - base));
+    env->value_count = base;
+    return keys;
+}
+
+// (hash_for_each fn table) calls fn with each key and its value. Entries
+// added while it runs may or may not be visited.
+static struct sexpr* eval_hash_for_each(struct env* env, struct sexpr* args)
+{
+    size_t base = env->value_count;
+    reserve_values(env, 4);
+
+    struct sexpr* fn = eval_type_argument(env, args, 0, function);
+    CHECK_ERROR(fn);
+    env->values[env->value_count++] = fn;
+
+    struct sexpr* table = eval_type_argument(env, args, 1, hash);
+    if (!table || tag_of(table) == error)
+    {
+        env->value_count = base;
+        return table;
+    }
+    env->values[env->value_count++] = table;
+    env->value_count += 2;
+
+    for (size_t i=0;i<env->values[base + 1]->table->capacity;i++)
+    {
+        struct hash_table* t = env->values[base + 1]->table;
+        if (!t->keys[i] || t->keys[i] == HASH_REMOVED)
+            continue;
+
+        env->values[base + 2] = t->keys[i];
+        env->values[base + 3] = t->values[i];
+        struct sexpr* result = apply_function(env, env->values[base], base + 2, 2);
+        if (!result || tag_of(result) == error)
+        {
+            env->value_count = base;
+            return result;
+        }
+    }
+
+    env->value_count = base;
+    return NIL;
+}
+
+// Compiles and runs a top level form
+static struct sexpr* eval_toplevel(struct env* env, struct sexpr* sexpr)
+{
+    size_t root_count = env->root_count;
+    struct sexpr* object = create_list(env, 1, sexpr);
+    push_root(env, &object);
+
+    object = compile_forms(env, object, NULL);
+    struct sexpr* result = tag_of(object) == error ? object : run_code(env, object->code);
+
+    env->root_count = root_count;
+    return result;
+}
+
+static void compact_heap_if_fragmented(struct env* env);
+struct form_cache_writer;
+static void cache_form(struct form_cache_writer* cache, struct sexpr* form);
+
+// Reads and runs every form of the input as it is read, stopping at the
+// first error. Returns the value of the last form. Objects may only move
+// between forms when nothing but the frames refers to the heap, that is when
+// the input isn't run from inside another form. Forms that are read are also
+// added to cache unless it is NULL.
+static struct sexpr* eval_input(struct env* env, struct input* input, bool outermost, struct form_cache_writer* cache)
+{
+    struct sexpr* result = NIL;
+    size_t root_count = env->root_count;
+    push_root(env, &result);
+
+    struct reader reader;
+    init_reader(env, &reader);
+
+    struct sexpr* form;
+    while ((form = next_form(env, &reader, input)))
+    {
+        result = form;
+        if (tag_of(result) == error)
+            break;
+
+        if (cache)
+            cache_form(cache, result);
+        result = eval_toplevel(env, result);
+        if (!result || tag_of(result) == error)
+            break;
+
+        if (outermost)
+            compact_heap_if_fragmented(env);
+    }
+
+    free_reader(env, &reader);
+    env->root_count = root_count;
+    return result;
+}
+
+static void write_sexpr(FILE* out, struct sexpr* sexpr)
+{
+    switch (tag_of(sexpr))
+    {
+    case error:
+        fprintf(out, "Error: %s", error_message(sexpr));
+        break;
+    case nil:
+        fprintf(out, "()");
+        break;
+    case integer:
+        fprintf(out, "%lld", (long long)integer_value(sexpr));
+        break;
+    case symbol:
+        fprintf(out, "%s", sexpr->name);
+        break;
+    case boolean:
+        if (sexpr == S_TRUE)
+            fprintf(out, "true");
+        else
+            fprintf(out, "false");
+        break;
+    case function:
+        switch (sexpr->function.tag)
+        {
+            case builtin:
+                fprintf(out, "<builtin function '%s'>", sexpr->function.builtin.name);
+                break;
+            case lambda:
+                fprintf(out, "<lambda function>");
+                break;
+        }
+        break;
+    case list:
+        fprintf(out, "(");
+        while (sexpr != NIL)
+        {
+            write_sexpr(out, sexpr->list.head);
+
+            if ((sexpr = sexpr->list.tail) != NIL)
+                fprintf(out, " ");
+        }
+        fprintf(out, ")");
+        break;
+    case hash:
+        fprintf(out, "<hash table with %zu entries>", sexpr->table->count);
+        break;
+    case string:
+        fprintf(out, "%s", sexpr->text);
+        break;
+    case vector:
+        fprintf(out, "[");
+        for (size_t i=0;i<sexpr->vector->length;i++)
+        {
+            if (i > 0)
+                fprintf(out, " ");
+            if (sexpr->vector->type == int_vector)
+                fprintf(out, "%lld", (long long)sexpr->vector->ints[i]);
+            else
+                write_sexpr(out, sexpr->vector->items[i]);
+        }
+        fprintf(out, "]");
+        break;
+    case code:
+        fprintf(out, "<code>");
+        break;
+    }
+}
+
+static void print_sexpr(struct sexpr* sexpr)
+{
+    write_sexpr(stdout, sexpr);
+}
+
+static struct sexpr* eval_print(struct env* env, struct sexpr* args)
+{
+    struct sexpr* arg;
+    while ((arg = next(&args)))
+    {
+        struct sexpr* value = eval_sexpr(env, arg);
+        CHECK_ERROR(value);
+        print_sexpr(value);
+    }
+
+    return NIL;
+}
+
+static struct sexpr* eval_printl(struct env* env, struct sexpr* args)
+{
+    eval_print(env, args);
+
+    printf("\n");
+
+    return NIL;
+}
+
+// Returns the longest garbage collection pause so far in microseconds
+static struct sexpr* eval_gc_max_pause(struct env* env, struct sexpr* args)
+{
+    return new_integer(env, (intptr_t)(max_gc_pause_ns(env) / 1000));
+}
+
+// Collects garbage and prints how many objects of each type are live and
+// how much memory they take
+static struct sexpr* eval_memory_report(struct env* env, struct sexpr* args)
+{
+    static const char* type_names[] = {"nil", "error", "list", "integer", "symbol", "function", "boolean", "vector", "hash", "string", "code"};
+    size_t counts[code + 1] = {0};
+    size_t bytes[code + 1] = {0};
+
+    collect_garbage(env);
+    finish_sweeping(env);
+
+    for (struct segment* segment = env->segments; segment; segment = segment->next)
+    {
+        for (size_t w=0;w<bitmap_words(segment);w++)
+        {
+            for (uint64_t used = segment->used_bits[w];used;used &= used - 1)
+            {
+                struct sexpr* object = block_at(segment, w * 64 + __builtin_ctzll(used));
+                enum sexpr_t tag = tag_of(object);
+                counts[tag]++;
+                bytes[tag] += (size_t)1 << segment->block_shift;
+                // Vectors, hash tables and strings are reported with their storage outside the heap
+                if (tag == vector)
+                    bytes[tag] += sizeof(struct vector) + vector_data_size(object->vector);
+                else if (tag == hash)
+                    bytes[tag] += hash_table_size(object->table);
+                else if (tag == string)
+                    bytes[tag] += strlen(object->text) + 1;
+            }
+        }
+    }
+
+    size_t total = 0;
+    for (int tag=0;tag<=code;tag++)
+    {
+        if (!counts[tag])
+            continue;
+        printf("%-9s %8zu objects %4zu bytes each %10zu bytes\n",
+            type_names[tag], counts[tag], bytes[tag] / counts[tag], bytes[tag]);
+        total += bytes[tag];
+    }
+    printf("%-9s %44zu bytes in %zu segments\n", "total", total, env->segment_count);
+
+    return NIL;
+}
+
+// A heap image holds the objects reachable from the global bindings, laid
+// out in segments just like in the heap as if they were at IMAGE_BASE.
+// Loading one maps the segments from the file there, so lists, which are
+// most of an image, are used as they are and their pages are only read
+// when they are needed. If something else is at that address the segments
+// go elsewhere and every address in them is relocated. After the segments
+// come the interned names that objects refer to by
+// number, the storage of code, vector, hash and string objects, and the
+// global bindings. Builtins are stored by name and looked up in the
+// builtin table when the image is loaded.
+#define IMAGE_VERSION 2
+// Segments start at a multiple of this in the file so they can be mapped
+// with any common page size
+#define IMAGE_ALIGNMENT (64 * 1024)
+// Far from where the system puts the program and its allocations
+#define IMAGE_BASE ((uint64_t)0x100000000000)
+
+struct image_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t pointer_size;
+    uint64_t segment_size;
+    uint64_t base; // Where the segments were laid out
+    // The segments of each class follow each other in class order
+    uint64_t segment_counts[SIZE_CLASSES];
+    // Bytes of names, external storage and bindings after the segments
+    uint64_t tail_size;
+};
+
+static const char image_magic[8] = "YALPIMG";
+
+// Numbers addresses in the order they are first added
+struct numbering
+{
+    const void** items; // Addresses by number
+    size_t count;
+    size_t capacity;
+    // Open addressing table of numbers plus one, zero is empty
+    size_t* table;
+    size_t table_capacity;
+};
+
+static size_t numbering_slot(struct numbering* numbering, const void* address)
+{
+    size_t mask = numbering->table_capacity - 1;
+    size_t slot = hash_name(address) & mask;
+    while (numbering->table[slot] && numbering->items[numbering->table[slot] - 1] != address)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+// Gives address the next number, false if it already has one
+static bool number_address(struct numbering* numbering, const void* address)
+{
+    if ((numbering->count + 1) * 2 > numbering->table_capacity)
+    {
+        free(numbering->table);
+        numbering->table_capacity = numbering->table_capacity ? numbering->table_capacity * 2 : 256;
+        numbering->table = calloc(numbering->table_capacity, sizeof(size_t));
+        for (size_t i=0;i<numbering->count;i++)
+            numbering->table[numbering_slot(numbering, numbering->items[i])] = i + 1;
+    }
+
+    size_t slot = numbering_slot(numbering, address);
+    if (numbering->table[slot])
+        return false;
+
+    if (numbering->count == numbering->capacity)
+    {
+        numbering->capacity = numbering->capacity ? numbering->capacity * 2 : 256;
+        numbering->items = realloc(numbering->items, sizeof(const void*) * numbering->capacity);
+    }
+    numbering->items[numbering->count++] = address;
+    numbering->table[slot] = numbering->count;
+    return true;
+}
+
+static size_t number_of(struct numbering* numbering, const void* address)
+{
+    return numbering->table[numbering_slot(numbering, address)] - 1;
+}
+
+static void free_numbering(struct numbering* numbering)
+{
+    free(numbering->items);
+    free(numbering->table);
+}
+
+struct image_writer
+{
+    FILE* file;
+    // Objects of each class by the block they get in the image
+    struct numbering objects[SIZE_CLASSES];
+    size_t first_segment[SIZE_CLASSES];
+    struct numbering names;
+    // Objects with storage outside the heap
+    struct numbering externals;
+};
+
+// Numbers an object and, like evacuate, the rest of its list spine so the
+// cells of a list end up next to each other
+static void reach_object(struct image_writer* writer, struct sexpr* sexpr)
+{
+    while (is_tracked(sexpr))
+    {
+        enum size_class size_class = segment_of(sexpr)->size_class;
+        if (!number_address(&writer->objects[size_class], sexpr) || size_class != cons_class)
+            return;
+        sexpr = sexpr->list.tail;
+    }
+}
+
+// Numbers what an object refers to
+static void scan_image_object(struct image_writer* writer, struct sexpr* sexpr)
+{
+    switch (tag_of(sexpr))
+    {
+        case list:
+            reach_object(writer, sexpr->list.head);
+            reach_object(writer, sexpr->list.tail);
+            break;
+        case symbol:
+            number_address(&writer->names, sexpr->name);
+            break;
+        case error:
+            number_address(&writer->names, sexpr->message);
+            break;
+        case function:
+            if (sexpr->function.tag == builtin)
+                number_address(&writer->names, sexpr->function.builtin.name);
+            else
+            {
+                reach_object(writer, sexpr->function.lambda.params);
+                reach_object(writer, sexpr->function.lambda.exprs);
+            }
+            break;
+        case vector:
+            number_address(&writer->externals, sexpr);
+            if (sexpr->vector->type == object_vector)
+            {
+                for (size_t i=0;i<sexpr->vector->length;i++)
+                    reach_object(writer, sexpr->vector->items[i]);
+            }
+            break;
+        case hash:
+            number_address(&writer->externals, sexpr);
+            for (size_t i=0;i<sexpr->table->capacity;i++)
+            {
+                reach_object(writer, sexpr->table->keys[i]);
+                reach_object(writer, sexpr->table->values[i]);
+            }
+            break;
+        case string:
+            number_address(&writer->externals, sexpr);
+            break;
+        case code:
+            number_address(&writer->externals, sexpr);
+            for (size_t i=0;i<sexpr->code->constant_count;i++)
+                reach_object(writer, sexpr->code->constants[i]);
+            break;
+        case nil:
+        case integer:
+        case boolean:
+            // Immediates are written as they are
+            break;
+    }
+}
+
+// Immediates are stored as they are and objects as the address they have
+// when the segments are at IMAGE_BASE
+static uint64_t image_address(struct image_writer* writer, struct sexpr* sexpr)
+{
+    if (!is_tracked(sexpr))
+        return (uintptr_t)sexpr;
+
+    enum size_class size_class = segment_of(sexpr)->size_class;
+    size_t number = number_of(&writer->objects[size_class], sexpr);
+    size_t per_segment = class_blocks(size_class);
+    return IMAGE_BASE + (writer->first_segment[size_class] + number / per_segment) * (uint64_t)SEGMENT_SIZE +
+        offsetof(struct segment, blocks) + ((number % per_segment) << class_shifts[size_class]);
+}
+
+static void write_u64(struct image_writer* writer, uint64_t value)
+{
+    fwrite(&value, sizeof(value), 1, writer->file);
+}
+
+static void write_addresses(struct image_writer* writer, struct sexpr** sexprs, size_t count)
+{
+    for (size_t i=0;i<count;i++)
+        write_u64(writer, image_address(writer, sexprs[i]));
+}
+
+// Copies an object into a segment of the image, with addresses, names and
+// storage outside the heap replaced by numbers
+static void copy_image_object(struct image_writer* writer, struct sexpr* sexpr, struct sexpr* copy, size_t size)
+{
+    memcpy(copy, sexpr, size);
+    switch (tag_of(sexpr))
+    {
+        case list:
+            copy->list.head = (struct sexpr*)(uintptr_t)image_address(writer, sexpr->list.head);
+            copy->list.tail = (struct sexpr*)(uintptr_t)image_address(writer, sexpr->list.tail);
+            break;
+        case symbol:
+            copy->name = (const char*)(uintptr_t)number_of(&writer->names, sexpr->name);
+            break;
+        case error:
+            copy->message = (const char*)(uintptr_t)number_of(&writer->names, sexpr->message);
+            break;
+        case function:
+            if (sexpr->function.tag == builtin)
+            {
+                copy->function.builtin.name = (const char*)(uintptr_t)number_of(&writer->names, sexpr->function.builtin.name);
+                copy->function.builtin.fn = NULL;
+            }
+            else
+            {
+                copy->function.lambda.params = (struct sexpr*)(uintptr_t)image_address(writer, sexpr->function.lambda.params);
+                copy->function.lambda.exprs = (struct sexpr*)(uintptr_t)image_address(writer, sexpr->function.lambda.exprs);
+            }
+            break;
+        default:
+            copy->text = (char*)(uintptr_t)number_of(&writer->externals, sexpr);
+            break;
+    }
+}
+
+static void write_external(struct image_writer* writer, struct sexpr* sexpr)
+{
+    write_u64(writer, tag_of(sexpr));
+    switch (tag_of(sexpr))
+    {
+        case string:
+        {
+            size_t length = strlen(sexpr->text);
+            write_u64(writer, length);
+            fwrite(sexpr->text, 1, length, writer->file);
+            break;
+        }
+        case vector:
+            write_u64(writer, sexpr->vector->type);
+            write_u64(writer, sexpr->vector->length);
+            if (sexpr->vector->type == int_vector)
+                fwrite(sexpr->vector->ints, sizeof(int64_t), sexpr->vector->length, writer->file);
+            else
+                write_addresses(writer, sexpr->vector->items, sexpr->vector->length);
+            break;
+        case hash:
+            write_u64(writer, sexpr->table->count);
+            write_u64(writer, sexpr->table->used);
+            write_u64(writer, sexpr->table->capacity);
+            write_addresses(writer, sexpr->table->keys, sexpr->table->capacity);
+            write_addresses(writer, sexpr->table->values, sexpr->table->capacity);
+            break;
+        default:
+            write_u64(writer, sexpr->code->op_count);
+            fwrite(sexpr->code->ops, sizeof(int), sexpr->code->op_count, writer->file);
+            write_u64(writer, sexpr->code->constant_count);
+            write_addresses(writer, sexpr->code->constants, sexpr->code->constant_count);
+            write_u64(writer, sexpr->code->max_depth);
+            write_u64(writer, sexpr->code->param_slots);
+            break;
+    }
+}
+
+static struct frame* global_frame(struct env* env)
+{
+    struct frame* frame = env->stack;
+    while (frame->previous)
+        frame = frame->previous;
+    return frame;
+}
+
+// Writes the global bindings and everything they refer to. Nothing is
+// allocated on the heap meanwhile, so objects stay where they are.
+static bool save_image(struct env* env, const char* path)
+{
+    struct image_writer writer = {0};
+    writer.file = fopen(path, "wb");
+    if (!writer.file)
+        return false;
+
+    struct frame* globals = global_frame(env);
+    for (int i=0;i<globals->binding_count;i++)
+    {
+        if (globals->bindings[i].name)
+        {
+            number_address(&writer.names, globals->bindings[i].name);
+            reach_object(&writer, globals->bindings[i].value);
+        }
+    }
+
+    // Scan the numbered objects in order while more are numbered, until
+    // every class is done
+    size_t scanned[SIZE_CLASSES] = {0};
+    bool scanning = true;
+    while (scanning)
+    {
+        scanning = false;
+        for (int c=0;c<SIZE_CLASSES;c++)
+        {
+            for (;scanned[c] < writer.objects[c].count;scanned[c]++)
+            {
+                scan_image_object(&writer, (struct sexpr*)writer.objects[c].items[scanned[c]]);
+                scanning = true;
+            }
+        }
+    }
+
+    struct image_header header = {0};
+    memcpy(header.magic, image_magic, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.pointer_size = sizeof(void*);
+    header.segment_size = SEGMENT_SIZE;
+    header.base = IMAGE_BASE;
+    size_t segment_count = 0;
+    for (int c=0;c<SIZE_CLASSES;c++)
+    {
+        size_t per_segment = class_blocks(c);
+        header.segment_counts[c] = (writer.objects[c].count + per_segment - 1) / per_segment;
+        writer.first_segment[c] = segment_count;
+        segment_count += header.segment_counts[c];
+    }
+
+    // The header is written again once the size of the tail is known
+    fwrite(&header, sizeof(header), 1, writer.file);
+    fseek(writer.file, IMAGE_ALIGNMENT, SEEK_SET);
+
+    struct segment* segment = malloc(SEGMENT_SIZE);
+    for (int c=0;c<SIZE_CLASSES;c++)
+    {
+        for (size_t s=0;s<header.segment_counts[c];s++)
+        {
+            memset(segment, 0, SEGMENT_SIZE);
+            init_segment(segment, c);
+            for (size_t i=0;i<segment->block_count;i++)
+            {
+                size_t number = s * segment->block_count + i;
+                if (number == writer.objects[c].count)
+                    break;
+                copy_image_object(&writer, (struct sexpr*)writer.objects[c].items[number],
+                    block_at(segment, i), (size_t)1 << segment->block_shift);
+                set_bit(segment->used_bits, i);
+                set_bit(segment->old_bits, i);
+            }
+            fwrite(segment, SEGMENT_SIZE, 1, writer.file);
+        }
+    }
+    free(segment);
+
+    long tail_start = ftell(writer.file);
+    write_u64(&writer, writer.names.count);
+    for (size_t i=0;i<writer.names.count;i++)
+    {
+        size_t length = strlen(writer.names.items[i]);
+        write_u64(&writer, length);
+        fwrite(writer.names.items[i], 1, length, writer.file);
+    }
+    write_u64(&writer, writer.externals.count);
+    for (size_t i=0;i<writer.externals.count;i++)
+        write_external(&writer, (struct sexpr*)writer.externals.items[i]);
+    size_t binding_count = 0;
+    for (int i=0;i<globals->binding_count;i++)
+        binding_count += globals->bindings[i].name != NULL;
+    write_u64(&writer, binding_count);
+    for (int i=0;i<globals->binding_count;i++)
+    {
+        if (globals->bindings[i].name)
+        {
+            write_u64(&writer, number_of(&writer.names, globals->bindings[i].name));
+            write_u64(&writer, image_address(&writer, globals->bindings[i].value));
+        }
+    }
+    header.tail_size = ftell(writer.file) - tail_start;
+    fseek(writer.file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, writer.file);
+
+    bool failed = ferror(writer.file);
+    failed |= fclose(writer.file) != 0;
+    for (int c=0;c<SIZE_CLASSES;c++)
+        free_numbering(&writer.objects[c]);
+    free_numbering(&writer.names);
+    free_numbering(&writer.externals);
+    return !failed;
+}
+
+// (save_image "file") writes the global bindings to an image, see --image
+static struct sexpr* eval_save_image(struct env* env, struct sexpr* args)
+{
+    struct sexpr* path = eval_type_argument(env, args, 0, string);
+    CHECK_ERROR(path);
+
+    if (!save_image(env, path->text))
+        return new_error(env, "Can't write image");
+    return S_TRUE;
+}
+
+static struct sexpr* eval_load(struct env* env, struct sexpr* args);
+
+// Every builtin by the name it is bound to. Images refer to builtins by
+// name, so they keep working when the functions move between builds.
+struct builtin_entry
+{
+    const char* name;
+    struct sexpr* (*fn) (struct env*, struct sexpr*);
+};
+
+static const struct builtin_entry builtins[] = {
+    {"+", eval_add},
+    {"-", eval_subtract},
+    {"*", eval_multiply},
+    {"/", eval_division},
+    {"=", eval_equals},
+    {"<", eval_less},
+    {"'", eval_quote},
+    {"quote", eval_quote},
+    {"list", eval_list},
+    {"define", eval_define},
+    {"if", eval_if},
+    {"lambda", eval_lambda},
+    {"defun", eval_defun},
+    {"reduce", eval_reduce},
+    {"map", eval_map},
+    {"filter", eval_filter},
+    {"for_each", eval_for_each},
+    {"vector", eval_vector},
+    {"int_vector", eval_int_vector},
+    {"make_vector", eval_make_vector},
+    {"make_int_vector", eval_make_int_vector},
+    {"vector_length", eval_vector_length},
+    {"vector_ref", eval_vector_ref},
+    {"vector_set", eval_vector_set},
+    {"vector_sum", eval_vector_sum},
+    {"vector_dot", eval_vector_dot},
+    {"vector_equal", eval_vector_equal},
+    {"vector_map", eval_vector_map},
+    {"make_hash", eval_make_hash},
+    {"hash_get", eval_hash_get},
+    {"hash_set", eval_hash_set},
+    {"hash_remove", eval_hash_remove},
+    {"hash_count", eval_hash_count},
+    {"hash_keys", eval_hash_keys},
+    {"hash_for_each", eval_hash_for_each},
+    {"load", eval_load},
+    {"save_image", eval_save_image},
+    {"print", eval_print},
+    {"printl", eval_printl},
+    {"gc_max_pause", eval_gc_max_pause},
+    {"memory_report", eval_memory_report},
+    {"recur", eval_recur},
+    {"loop", eval_loop},
+    {"progn", eval_progn},
+};
+
+#define BUILTIN_COUNT (sizeof(builtins) / sizeof(builtins[0]))
+
+// Reads the tail of an image, running past its end sets failed
+struct image_reader
+{
+    const char* pos;
+    const char* end;
+    bool failed;
+};
+
+static const void* read_image_bytes(struct image_reader* reader, uint64_t length)
+{
+    if (reader->failed || length > (uint64_t)(reader->end - reader->pos))
+    {
+        reader->failed = true;
+        return NULL;
+    }
+    const void* bytes = reader->pos;
+    reader->pos += length;
+    return bytes;
+}
+
+// Only the command line interpreter loads images, see --image
+#ifndef YALP_NO_MAIN
+
+static struct sexpr* (*builtin_function(const char* name)) (struct env*, struct sexpr*)
+{
+    for (size_t i=0;i<BUILTIN_COUNT;i++)
+    {
+        if (strcmp(builtins[i].name, name) == 0)
+            return builtins[i].fn;
+    }
+    return NULL;
+}
+
+static uint64_t read_u64(struct image_reader* reader)
+{
+    uint64_t value = 0;
+    const void* bytes = read_image_bytes(reader, sizeof(value));
+    if (bytes)
+        memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+// Where the segments of an image were mapped
+struct image_mapping
+{
+    char* base;
+    size_t size;
+    uint64_t saved_base; // Where the image was laid out, see IMAGE_BASE
+};
+
+// Turns a stored address back into one, see image_address
+static struct sexpr* image_object(struct image_mapping* mapping, uint64_t address, bool* failed)
+{
+    if (!address || (address & 3))
+        return (struct sexpr*)(uintptr_t)address;
+    if (address - mapping->saved_base >= mapping->size)
+    {
+        *failed = true;
+        return NULL;
+    }
+    return (struct sexpr*)(mapping->base + (address - mapping->saved_base));
+}
+
+static void read_addresses(struct image_reader* reader, struct image_mapping* mapping, struct sexpr** sexprs, size_t count)
+{
+    for (size_t i=0;i<count;i++)
+        sexprs[i] = image_object(mapping, read_u64(reader), &reader->failed);
+}
+
+// Reads the storage of a code, vector, hash or string object into a
+// malloc'd copy, the tag says which
+static void* read_external(struct image_reader* reader, struct image_mapping* mapping, enum sexpr_t* tag)
+{
+    *tag = read_u64(reader);
+    switch (*tag)
+    {
+        case string:
+        {
+            uint64_t length = read_u64(reader);
+            const char* bytes = read_image_bytes(reader, length);
+            if (!bytes)
+                return NULL;
+            char* text = malloc(length + 1);
+            memcpy(text, bytes, length);
+            text[length] = '\0';
+            return text;
+        }
+        case vector:
+        {
+            enum vector_t type = read_u64(reader);
+            uint64_t length = read_u64(reader);
+            if (reader->failed || length > (uint64_t)(reader->end - reader->pos) / sizeof(int64_t))
+                return NULL;
+            struct vector* v = malloc(sizeof(struct vector));
+            v->type = type == int_vector ? int_vector : object_vector;
+            v->length = length;
+            v->items = malloc(vector_data_size(v) ? vector_data_size(v) : 1);
+            if (v->type == int_vector)
+                memcpy(v->ints, read_image_bytes(reader, length * sizeof(int64_t)), length * sizeof(int64_t));
+            else
+                read_addresses(reader, mapping, v->items, length);
+            return v;
+        }
+        case hash:
+        {
+            struct hash_table* table = malloc(sizeof(struct hash_table));
+            table->count = read_u64(reader);
+            table->used = read_u64(reader);
+            table->capacity = read_u64(reader);
+            bool fits = !reader->failed && table->capacity &&
+                !(table->capacity & (table->capacity - 1)) &&
+                table->capacity <= (uint64_t)(reader->end - reader->pos) / (2 * sizeof(uint64_t));
+            if (!fits)
+            {
+                free(table);
+                reader->failed = true;
+                return NULL;
+            }
+            table->keys = malloc(sizeof(struct sexpr*) * table->capacity);
+            table->values = malloc(sizeof(struct sexpr*) * table->capacity);
+            read_addresses(reader, mapping, table->keys, table->capacity);
+            read_addresses(reader, mapping, table->values, table->capacity);
+            return table;
+        }
+        case code:
+        {
+            uint64_t op_count = read_u64(reader);
+            const int* ops = read_image_bytes(reader, op_count * sizeof(int));
+            uint64_t constant_count = read_u64(reader);
+            if (!ops || reader->failed || constant_count > (uint64_t)(reader->end - reader->pos) / sizeof(uint64_t))
+            {
+                reader->failed = true;
+                return NULL;
+            }
+            struct code* code = malloc(sizeof(struct code));
+            code->op_count = op_count;
+            code->ops = malloc(sizeof(int) * (op_count ? op_count : 1));
+            memcpy(code->ops, ops, sizeof(int) * op_count);
+            code->constant_count = constant_count;
+            code->constants = malloc(sizeof(struct sexpr*) * (constant_count ? constant_count : 1));
+            read_addresses(reader, mapping, code->constants, constant_count);
+            code->max_depth = read_u64(reader);
+            code->param_slots = read_u64(reader);
+            return code;
+        }
+        default:
+            reader->failed = true;
+            return NULL;
+    }
+}
+
+static void free_external_storage(enum sexpr_t tag, void* storage)
+{
+    struct sexpr object = {0};
+    object.tag = tag;
+    object.text = storage;
+    free_external(&object);
+}
+
+// Fixes up the fields of an object in a mapped segment, see copy_image_object
+static bool fix_image_object(struct image_mapping* mapping, struct sexpr* sexpr, enum size_class size_class,
+    const char** names, size_t name_count, void** externals, enum sexpr_t* external_tags, size_t external_count)
+{
+    bool failed = false;
+    if (size_class == cons_class)
+    {
+        sexpr->list.head = image_object(mapping, (uintptr_t)sexpr->list.head, &failed);
+        sexpr->list.tail = image_object(mapping, (uintptr_t)sexpr->list.tail, &failed);
+        return !failed;
+    }
+
+    switch (sexpr->tag)
+    {
+        case symbol:
+        case error:
+            if ((uintptr_t)sexpr->name >= name_count)
+                return false;
+            sexpr->name = names[(uintptr_t)sexpr->name];
+            return true;
+        case function:
+            if (size_class != function_class)
+                return false;
+            if (sexpr->function.tag == builtin)
+            {
+                if ((uintptr_t)sexpr->function.builtin.name >= name_count)
+                    return false;
+                sexpr->function.builtin.name = names[(uintptr_t)sexpr->function.builtin.name];
+                sexpr->function.builtin.fn = builtin_function(sexpr->function.builtin.name);
+                return sexpr->function.builtin.fn != NULL;
+            }
+            sexpr->function.lambda.params = image_object(mapping, (uintptr_t)sexpr->function.lambda.params, &failed);
+            sexpr->function.lambda.exprs = image_object(mapping, (uintptr_t)sexpr->function.lambda.exprs, &failed);
+            return !failed;
+        case vector:
+        case hash:
+        case string:
+        case code:
+        {
+            uintptr_t index = (uintptr_t)sexpr->text;
+            if (index >= external_count || external_tags[index] != sexpr->tag || !externals[index])
+                return false;
+            sexpr->text = externals[index];
+            externals[index] = NULL; // Owned by the object now
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+// Maps the segments of an image into memory where they were laid out if
+// possible, or else somewhere at SEGMENT_SIZE alignment. The mapping is
+// private so that writes to it aren't written back to the file.
+static bool map_image_segments(int fd, size_t segment_count, struct image_mapping* mapping)
+{
+    mapping->size = segment_count * SEGMENT_SIZE;
+    mapping->base = NULL;
+    if (!segment_count)
+        return true;
+
+    // Older kernels take the address as a hint only
+    char* saved_base = (char*)(uintptr_t)mapping->saved_base;
+    char* base = mmap(saved_base, mapping->size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd, IMAGE_ALIGNMENT);
+    if (base == saved_base)
+    {
+        mapping->base = base;
+        return true;
+    }
+    if (base != MAP_FAILED)
+        munmap(base, mapping->size);
+
+    char* reserved = mmap(NULL, mapping->size + SEGMENT_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (reserved == MAP_FAILED)
+        return false;
+    base = (char*)(((uintptr_t)reserved + SEGMENT_SIZE - 1) & ~(uintptr_t)(SEGMENT_SIZE - 1));
+    if (base > reserved)
+        munmap(reserved, base - reserved);
+    munmap(base + mapping->size, reserved + SEGMENT_SIZE - base);
+
+    if (mmap(base, mapping->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, IMAGE_ALIGNMENT) == MAP_FAILED)
+    {
+        munmap(base, mapping->size);
+        return false;
+    }
+    mapping->base = base;
+    return true;
+}
+
+// Puts the heap and global bindings of an image into env, which must be
+// fresh from set_env. Prints why to stderr and returns false when it
+// can't.
+static bool load_image(struct env* env, const char* path)
+{
+    const char* problem = NULL;
+    int fd = open(path, O_RDONLY);
+    struct image_header header;
+    if (fd < 0)
+        problem = "can't read file";
+    else if (read(fd, &header, sizeof(header)) != sizeof(header) || memcmp(header.magic, image_magic, sizeof(header.magic)) != 0)
+        problem = "not an image";
+    else if (header.version != IMAGE_VERSION || header.pointer_size != sizeof(void*) || header.segment_size != SEGMENT_SIZE)
+        problem = "made by an incompatible build";
+    if (problem)
+    {
+        fprintf(stderr, "Can't load image %s: %s\n", path, problem);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    size_t segment_count = 0;
+    for (int c=0;c<SIZE_CLASSES;c++)
+        segment_count += header.segment_counts[c];
+
+    struct image_mapping mapping;
+    mapping.saved_base = header.base;
+    char* tail = malloc(header.tail_size ? header.tail_size : 1);
+    off_t tail_offset = IMAGE_ALIGNMENT + (off_t)segment_count * SEGMENT_SIZE;
+    if (pread(fd, tail, header.tail_size, tail_offset) != (ssize_t)header.tail_size)
+        problem = "file is truncated";
+    else if (!map_image_segments(fd, segment_count, &mapping))
+        problem = "can't map segments";
+    close(fd);
+    if (problem)
+    {
+        fprintf(stderr, "Can't load image %s: %s\n", path, problem);
+        free(tail);
+        return false;
+    }
+
+    struct image_reader reader = {tail, tail + header.tail_size, false};
+
+    size_t name_count = read_u64(&reader);
+    if (name_count > header.tail_size)
+        reader.failed = true;
+    const char** names = malloc(sizeof(const char*) * (reader.failed ? 1 : name_count + 1));
+    for (size_t i=0;i<name_count && !reader.failed;i++)
+    {
+        uint64_t length = read_u64(&reader);
+        const char* name = read_image_bytes(&reader, length);
+        if (name)
+            names[i] = intern(env, name, length);
+    }
+
+    size_t external_count = reader.failed ? 0 : read_u64(&reader);
+    if (external_count > header.tail_size)
+    {
+        reader.failed = true;
+        external_count = 0;
+    }
+    void** externals = calloc(external_count + 1, sizeof(void*));
+    enum sexpr_t* external_tags = calloc(external_count + 1, sizeof(enum sexpr_t));
+    for (size_t i=0;i<external_count && !reader.failed;i++)
+        externals[i] = read_external(&reader, &mapping, &external_tags[i]);
+
+    // Fix up the objects. Lists only hold addresses, which are right unless
+    // the segments had to go elsewhere.
+    bool relocated = mapping.base != (char*)(uintptr_t)mapping.saved_base;
+    size_t segment_index = 0;
+    for (int c=0;c<SIZE_CLASSES && !reader.failed;c++)
+    {
+        for (size_t s=0;s<header.segment_counts[c] && !reader.failed;s++)
+        {
+            struct segment* segment = (struct segment*)(mapping.base + segment_index++ * SEGMENT_SIZE);
+            if (segment->size_class != (enum size_class)c || segment->block_shift != class_shifts[c] ||
+                segment->block_count != class_blocks(c))
+            {
+                reader.failed = true;
+                break;
+            }
+            if (c == cons_class && !relocated)
+                continue;
+            for (size_t w=0;w<bitmap_words(segment) && !reader.failed;w++)
+            {
+                for (uint64_t used = segment->used_bits[w];used && !reader.failed;used &= used - 1)
+                {
+                    struct sexpr* object = block_at(segment, w * 64 + __builtin_ctzll(used));
+                    if (!fix_image_object(&mapping, object, c, names, name_count, externals, external_tags, external_count))
+                        reader.failed = true;
+                }
+            }
+        }
+    }
+
+    size_t binding_count = reader.failed ? 0 : read_u64(&reader);
+    if (binding_count > header.tail_size)
+    {
+        reader.failed = true;
+        binding_count = 0;
+    }
+    const char** binding_names = malloc(sizeof(const char*) * (binding_count + 1));
+    struct sexpr** binding_values = malloc(sizeof(struct sexpr*) * (binding_count + 1));
+    for (size_t i=0;i<binding_count && !reader.failed;i++)
+    {
+        uint64_t name = read_u64(&reader);
+        binding_values[i] = image_object(&mapping, read_u64(&reader), &reader.failed);
+        if (name >= name_count)
+            reader.failed = true;
+        else
+            binding_names[i] = names[name];
+    }
+    free(names);
+    free(tail);
+
+    for (size_t i=0;i<external_count;i++)
+    {
+        if (externals[i])
+            free_external_storage(external_tags[i], externals[i]);
+    }
+    free(externals);
+    free(external_tags);
+
+    if (reader.failed)
+    {
+        // Objects that took over storage of their own are simply dropped
+        // with the mapping, what they own leaks
+        fprintf(stderr, "Can't load image %s: file is corrupt\n", path);
+        if (mapping.base)
+            munmap(mapping.base, mapping.size);
+        free(binding_names);
+        free(binding_values);
+        return false;
+    }
+
+    segment_index = 0;
+    for (int c=0;c<SIZE_CLASSES;c++)
+    {
+        struct heap_class* heap_class = &env->classes[c];
+        for (size_t s=0;s<header.segment_counts[c];s++)
+        {
+            struct segment* segment = (struct segment*)(mapping.base + segment_index++ * SEGMENT_SIZE);
+            // Every object was written old and unmarked, as only what
+            // survives stays in the heap long enough to be saved
+            segment->mapped = true;
+            size_t used = 0;
+            for (size_t w=0;w<bitmap_words(segment);w++)
+                used += __builtin_popcountll(segment->used_bits[w]);
+            for (size_t w=0;w<bitmap_words(segment) && c != cons_class;w++)
+            {
+                for (uint64_t owner = segment->used_bits[w];owner;owner &= owner - 1)
+                {
+                    struct sexpr* object = block_at(segment, w * 64 + __builtin_ctzll(owner));
+                    if (object->tag == vector || object->tag == hash || object->tag == string || object->tag == code)
+                        add_external_object(env, object);
+                }
+            }
+
+            segment->next = env->segments;
+            env->segments = segment;
+            env->segment_count++;
+            heap_class->blocks += segment->block_count;
+            heap_class->free_count += segment->block_count - used;
+        }
+        heap_class->alloc_segment = env->segments;
+        heap_class->alloc_word = 0;
+        heap_class->alloc_bits = 0;
+    }
+
+    for (size_t i=0;i<binding_count;i++)
+        add_env_binding(env, binding_names[i], binding_values[i]);
+    free(binding_names);
+    free(binding_values);
+
+    grow_heap_if_crowded(env);
+    return true;
+}
+
+#endif
+
+// Sources that are loaded or run as scripts are cached next to them in
+// FILE.cache as the forms the reader made of them, so while a source is
+// unchanged it isn't read again. A cache starts with the size and
+// modification time of its source and the interned names its symbols refer
+// to by number, then come the forms. Each is a tag byte followed by varints:
+// the value of an integer, the number of a symbol, the length and bytes of a
+// string or the element count of a list followed by its elements.
+#define FORM_CACHE_VERSION 1
+#define FORM_CACHE_SUFFIX ".cache"
+
+struct form_cache_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    // Of the source the forms were read from
+    uint64_t source_size;
+    int64_t source_seconds;
+    int64_t source_nanoseconds;
+};
+
+static const char form_cache_magic[8] = "YALPFRM";
+
+enum cached_form_t {cached_nil, cached_true, cached_false, cached_integer, cached_symbol, cached_string, cached_list};
+
+struct byte_buffer
+{
+    char* bytes;
+    size_t length;
+    size_t capacity;
+};
+
+static void put_bytes(struct byte_buffer* buffer, const void* bytes, size_t length)
+{
+    if (buffer->length + length > buffer->capacity)
+    {
+        if (!buffer->capacity)
+            buffer->capacity = 4096;
+        while (buffer->length + length > buffer->capacity)
+            buffer->capacity *= 2;
+        buffer->bytes = realloc(buffer->bytes, buffer->capacity);
+    }
+    memcpy(buffer->bytes + buffer->length, bytes, length);
+    buffer->length += length;
+}
+
+// Seven bits per byte, the high bit is set on every byte but the last
+static void put_varint(struct byte_buffer* buffer, uint64_t value)
+{
+    unsigned char bytes[10];
+    size_t length = 0;
+    do
+    {
+        bytes[length] = value & 0x7f;
+        value >>= 7;
+        if (value)
+            bytes[length] |= 0x80;
+        length++;
+    } while (value);
+    put_bytes(buffer, bytes, length);
+}
+
+static void put_cached_tag(struct byte_buffer* buffer, enum cached_form_t tag)
+{
+    unsigned char byte = tag;
+    put_bytes(buffer, &byte, 1);
+}
+
+struct form_cache_writer
+{
+    struct byte_buffer forms;
+    struct numbering names;
+    // A form had something in it that the reader doesn't make
+    bool failed;
+};
+
+// Adds a form the reader made to the cache
+static void cache_form(struct form_cache_writer* cache, struct sexpr* form)
+{
+    switch (tag_of(form))
+    {
+        case nil:
+            put_cached_tag(&cache->forms, cached_nil);
+            break;
+        case boolean:
+            put_cached_tag(&cache->forms, form == S_TRUE ? cached_true : cached_false);
+            break;
+        case integer:
+        {
+            // Zigzag, so small negative numbers stay short
+            intptr_t n = integer_value(form);
+            put_cached_tag(&cache->forms, cached_integer);
+            put_varint(&cache->forms, ((uint64_t)n << 1) ^ (n < 0 ? UINT64_MAX : 0));
+            break;
+        }
+        case symbol:
+            number_address(&cache->names, form->name);
+            put_cached_tag(&cache->forms, cached_symbol);
+            put_varint(&cache->forms, number_of(&cache->names, form->name));
+            break;
+        case string:
+        {
+            size_t length = strlen(form->text);
+            put_cached_tag(&cache->forms, cached_string);
+            put_varint(&cache->forms, length);
+            put_bytes(&cache->forms, form->text, length);
+            break;
+        }
+        case list:
+        {
+            size_t count = 0;
+            struct sexpr* element = form;
+            for (;tag_of(element) == list;element = element->list.tail)
+                count++;
+            if (element != NIL)
+            {
+                cache->failed = true;
+                break;
+            }
+            put_cached_tag(&cache->forms, cached_list);
+            put_varint(&cache->forms, count);
+            for (element = form;element != NIL;element = element->list.tail)
+                cache_form(cache, element->list.head);
+            break;
+        }
+        default:
+            cache->failed = true;
+    }
+}
+
+// Writes the cache through a temporary file, so that a cache that is
+// being written is never read
+static void write_form_cache(struct form_cache_writer* cache, const char* cache_path, const struct stat* source)
+{
+    struct form_cache_header header = {0};
+    memcpy(header.magic, form_cache_magic, sizeof(header.magic));
+    header.version = FORM_CACHE_VERSION;
+    header.source_size = source->st_size;
+    header.source_seconds = source->st_mtim.tv_sec;
+    header.source_nanoseconds = source->st_mtim.tv_nsec;
+
+    struct byte_buffer names = {0};
+    put_varint(&names, cache->names.count);
+    for (size_t i=0;i<cache->names.count;i++)
+    {
+        size_t length = strlen(cache->names.items[i]);
+        put_varint(&names, length);
+        put_bytes(&names, cache->names.items[i], length);
+    }
+
+    char temporary[strlen(cache_path) + 8];
+    sprintf(temporary, "%s.XXXXXX", cache_path);
+    int fd = mkstemp(temporary);
+    // Readable by whoever can read the source
+    if (fd >= 0)
+        fchmod(fd, source->st_mode & 0666);
+    FILE* file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (file)
+    {
+        fwrite(&header, sizeof(header), 1, file);
+        fwrite(names.bytes, 1, names.length, file);
+        fwrite(cache->forms.bytes, 1, cache->forms.length, file);
+        bool failed = ferror(file);
+        failed |= fclose(file) != 0;
+        if (failed || rename(temporary, cache_path) != 0)
+            unlink(temporary);
+    }
+    else if (fd >= 0)
+    {
+        close(fd);
+        unlink(temporary);
+    }
+    free(names.bytes);
+}
+
+// Reads a varint, see put_varint
+static uint64_t read_varint(struct image_reader* reader)
+{
+    uint64_t value = 0;
+    for (int shift=0;shift<64;shift+=7)
+    {
+        const unsigned char* byte = read_image_bytes(reader, 1);
+        if (!byte)
+            return 0;
+        value |= (uint64_t)(*byte & 0x7f) << shift;
+        if (!(*byte & 0x80))
+            return value;
+    }
+    reader->failed = true;
+    return 0;
+}
+
+// Checks that the forms are whole and only refer to names that exist, so
+// that running them can't stop halfway because the cache is bad
+static bool check_cached_forms(struct image_reader reader, size_t name_count)
+{
+    // Elements still to come of the lists so far
+    uint64_t owed = 0;
+    while (reader.pos < reader.end && !reader.failed)
+    {
+        if (owed)
+            owed--;
+        const unsigned char* tag = read_image_bytes(&reader, 1);
+        switch (*tag)
+        {
+            case cached_nil:
+            case cached_true:
+            case cached_false:
+                break;
+            case cached_integer:
+                read_varint(&reader);
+                break;
+            case cached_symbol:
+                if (read_varint(&reader) >= name_count)
+                    return false;
+                break;
+            case cached_string:
+                read_image_bytes(&reader, read_varint(&reader));
+                break;
+            case cached_list:
+            {
+                uint64_t count = read_varint(&reader);
+                if (count > (uint64_t)(reader.end - reader.pos))
+                    return false;
+                owed += count;
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    return !reader.failed && owed == 0;
 }
 
-int multiply(int a, int b) {
-    return a * b;
-}
+// The cache of a source while its forms are run
+struct form_cache
+{
+    char* bytes;
+    struct image_reader forms;
+    const char** names;
+};
 
-struct sexpr* eval_multiply(struct env* env, struct sexpr* args)
+// Reads the cache at cache_path, false when there is none or it isn't for
+// the source as it is now
+static bool read_form_cache(struct env* env, const char* cache_path, const struct stat* source, struct form_cache* cache)
 {
-    return eval_int_operator(env, args, multiply, 1);
-}
+    int fd = open(cache_path, O_RDONLY);
+    if (fd < 0)
+        return false;
 
-int divide(int a, int b) {
-    return a / b;
-}
+    struct stat info;
+    char* bytes = NULL;
+    if (fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(struct form_cache_header))
+    {
+        bytes = malloc(info.st_size);
+        if (read(fd, bytes, info.st_size) != info.st_size)
+        {
+            free(bytes);
+            bytes = NULL;
+        }
+    }
+    close(fd);
+    if (!bytes)
+        return false;
+
+    struct form_cache_header header;
+    memcpy(&header, bytes, sizeof(header));
+    if (memcmp(header.magic, form_cache_magic, sizeof(header.magic)) != 0 || header.version != FORM_CACHE_VERSION ||
+        header.source_size != (uint64_t)source->st_size || header.source_seconds != source->st_mtim.tv_sec ||
+        header.source_nanoseconds != source->st_mtim.tv_nsec)
+    {
+        free(bytes);
+        return false;
+    }
 
-struct sexpr* eval_division(struct env* env, struct sexpr* args)
-{
-    if (args == NIL || args->list.tail == NIL)
-        return eval_int_operator(env, args, divide, 1);
-    else
+    struct image_reader reader = {bytes + sizeof(header), bytes + info.st_size, false};
+    size_t name_count = read_varint(&reader);
+    if (name_count > (size_t)(reader.end - reader.pos))
+        reader.failed = true;
+    const char** names = malloc(sizeof(const char*) * (reader.failed ? 1 : name_count + 1));
+    for (size_t i=0;i<name_count && !reader.failed;i++)
     {
-        struct sexpr* first = eval_argument(env, args, 0);
-        CHECK_ERROR(first);
-        return eval_int_operator(env, args->list.tail, divide, as_integer(first));
+        uint64_t length = read_varint(&reader);
+        const char* name = read_image_bytes(&reader, length);
+        if (name)
+            names[i] = intern(env, name, length);
+    }
+
+    if (reader.failed || !check_cached_forms(reader, name_count))
+    {
+        free(names);
+        free(bytes);
+        return false;
     }
+
+    cache->bytes = bytes;
+    cache->forms = reader;
+    cache->names = names;
+    return true;
 }
 
-struct sexpr* eval_quote(struct env* env, struct sexpr* args)
+static void free_form_cache(struct form_cache* cache)
 {
-    return args->list.head; // Quote returns the unevaluated first argument
+    free(cache->bytes);
+    free(cache->names);
 }
 
-struct sexpr* eval_list(struct env* env, struct sexpr* args)
+// Makes the next form of a cache that passed check_cached_forms
+static struct sexpr* next_cached_form(struct env* env, struct form_cache* cache)
 {
-    struct sexpr* head = NIL;
-    struct sexpr* previous = NULL;
+    const unsigned char* tag = read_image_bytes(&cache->forms, 1);
+    switch (*tag)
+    {
+        case cached_nil:
+            return NIL;
+        case cached_true:
+            return S_TRUE;
+        case cached_false:
+            return S_FALSE;
+        case cached_integer:
+        {
+            uint64_t value = read_varint(&cache->forms);
+            return new_integer(env, (intptr_t)(value >> 1) ^ -(intptr_t)(value & 1));
+        }
+        case cached_symbol:
+        {
+            // Like new_symbol, the name is interned already
+            struct sexpr* e = new_sexpr(env, symbol);
+            if (e == MEMORY_ERROR)
+                return e;
+            e->name = cache->names[read_varint(&cache->forms)];
+            return e;
+        }
+        case cached_string:
+        {
+            uint64_t length = read_varint(&cache->forms);
+            return new_string(env, read_image_bytes(&cache->forms, length), length);
+        }
+    }
 
-    struct sexpr* el;
-    while ((el = next(&args)))
+    uint64_t count = read_varint(&cache->forms);
+    size_t root_count = env->root_count;
+    struct sexpr* head = NIL;
+    struct sexpr* last = NIL;
+    struct sexpr* element = NIL;
+    push_root(env, &head);
+    push_root(env, &last);
+    push_root(env, &element);
+    for (uint64_t i=0;i<count;i++)
     {
-        struct sexpr* cell = new_sexpr(env, list);
-        cell->list.head = eval_sexpr(env, el);
+        element = next_cached_form(env, cache);
+        struct sexpr* cell = tag_of(element) == error ? element : new_sexpr(env, list);
+        if (cell == MEMORY_ERROR || tag_of(cell) == error)
+        {
+            env->root_count = root_count;
+            return cell;
+        }
+        cell->list.head = element;
         cell->list.tail = NIL;
-        if (previous)
-            previous->list.tail = cell;
-        else
+        if (last == NIL)
             head = cell;
-        previous = cell;
+        else
+        {
+            last->list.tail = cell;
+            write_barrier(env, last);
+        }
+        last = cell;
     }
-
+    env->root_count = root_count;
     return head;
 }
 
-struct sexpr* eval_argument(struct env* env, struct sexpr* args, int n)
-{
-    while (n-- > 0)
-        next(&args);
-
-    if (args != NIL)
-        return eval_sexpr(env,args->list.head);
-    else
-        return NIL;
-}
-
-struct sexpr* eval_type_argument(struct env* env, struct sexpr* args, int n, enum sexpr_t type)
-{
-    struct sexpr* arg = eval_argument(env, args, n);
-    CHECK_ERROR(arg);
-    if (arg->tag != type)
-        return new_error(env, "Argument is of wrong type");
-    return arg;
-}
-
-
-struct sexpr* eval_define(struct env* env, struct sexpr* args)
+// Like eval_input, for the forms of a cache
+static struct sexpr* eval_cached_forms(struct env* env, struct form_cache* cache, bool outermost)
 {
-    struct sexpr* sym = args->list.head;
-
-    CHECK_ERROR(sym);
+    struct sexpr* result = NIL;
+    size_t root_count = env->root_count;
+    push_root(env, &result);
 
-    if (sym->tag != symbol)
+    while (cache->forms.pos < cache->forms.end)
     {
-        return new_error(env, "Argument not evaluated to symbol");
-    }
-
-    struct sexpr* value = eval_argument(env, args, 1);
+        result = next_cached_form(env, cache);
+        if (tag_of(result) == error)
+            break;
 
-    CHECK_ERROR(value);
+        result = eval_toplevel(env, result);
+        if (!result || tag_of(result) == error)
+            break;
 
-    add_env_binding(env, sym->name, value);
+        if (outermost)
+            compact_heap_if_fragmented(env);
+    }
 
-    return value;
+    env->root_count = root_count;
+    return result;
 }
 
-struct sexpr* call_lambda(struct env* env, struct sexpr* lambda, struct sexpr* args)
+// Runs the source at path, open as fd, from its cache when the cache is
+// fresh. Otherwise the source is read and, if every form of it ran, what
+// was read is cached.
+static struct sexpr* eval_source(struct env* env, int fd, const char* path, bool outermost)
 {
-    struct sexpr* params = lambda->function.lambda.params;
-    struct sexpr* body = lambda->function.lambda.exprs;
-
-    push_stack_frame(env, lambda);
+    struct stat source;
+    bool cached = env->form_cache && fstat(fd, &source) == 0 && S_ISREG(source.st_mode);
+    char cache_path[strlen(path) + sizeof(FORM_CACHE_SUFFIX)];
+    sprintf(cache_path, "%s%s", path, FORM_CACHE_SUFFIX);
 
-    // Iterate over and bind parameters
-    struct sexpr* param;
-    int pos = 0;
-    while ((param = next(&params)))
+    struct form_cache cache;
+    if (cached && read_form_cache(env, cache_path, &source, &cache))
     {
-        struct sexpr* arg = eval_argument(env, args, pos);
-
-        if (!arg)
-        {
-            pop_stack_frame(env);
-            return new_error(env, "Not enough arguments for lambda function");
-        }
-
-        add_env_binding(env, param->name, arg);
-        pos++;
+        struct sexpr* result = eval_cached_forms(env, &cache, outermost);
+        free_form_cache(&cache);
+        return result;
     }
 
-    struct sexpr* result = NULL;
-    struct sexpr* expr;
-    while ((expr = next(&body)))
-        result = eval_sexpr(env, expr);
+    struct form_cache_writer writer = {0};
+    struct input input;
+    init_fd_input(&input, fd);
+    struct sexpr* result = eval_input(env, &input, outermost, cached ? &writer : NULL);
+    free_input(&input);
+    if (cached && result && tag_of(result) != error && !writer.failed)
+        write_form_cache(&writer, cache_path, &source);
+    free(writer.forms.bytes);
+    free_numbering(&writer.names);
+    return result;
+}
 
-    // Popping stack frame also clears bindings
-    pop_stack_frame(env);
+// (load "file") runs the forms in a file and returns the value of the last
+static struct sexpr* eval_load(struct env* env, struct sexpr* args)
+{
+    struct sexpr* path = eval_type_argument(env, args, 0, string);
+    CHECK_ERROR(path);
 
-    CHECK_ERROR(result);
+    int fd = open(path->text, O_RDONLY);
+    if (fd < 0)
+        return new_error(env, "Can't read file");
 
+    struct sexpr* result = eval_source(env, fd, path->text, false);
+    close(fd);
     return result;
 }
 
-
-struct sexpr* eval_loop(struct env* env, struct sexpr* args)
+static void set_env(struct env* env, struct heap_config heap_config)
 {
-    int arg_count = list_length(args);
+    env->heap_config = heap_config;
+    env->segments = NULL;
+    env->segment_count = 0;
+    memset(env->classes, 0, sizeof(env->classes));
+    env->sweep_segment = NULL;
+    env->sweep_pending = 0;
+    env->nursery_capacity = heap_config.nursery_blocks ? heap_config.nursery_blocks : 1;
+    env->nursery = malloc(sizeof(struct sexpr*) * env->nursery_capacity);
+    env->nursery_count = 0;
+    env->remembered = NULL;
+    env->remembered_count = 0;
+    env->remembered_capacity = 0;
+    env->collecting_young = false;
+    env->gray = NULL;
+    env->gray_count = 0;
+    env->gray_capacity = 0;
+    env->gc_phase = gc_idle;
+    env->allocs_since_step = 0;
+    env->max_pause_ns = 0;
+    env->full_collections = 0;
+    env->compacted_collections = 0;
+    env->interned = NULL;
+    env->interned_count = 0;
+    env->interned_capacity = 0;
+    env->values = NULL;
+    env->value_count = 0;
+    env->value_capacity = 0;
+    env->compiler = NULL;
+    env->reader = NULL;
+    env->form_cache = true;
+    env->external_objects = NULL;
+    env->external_object_count = 0;
+    env->external_object_capacity = 0;
+    env->external_bytes = 0;
+    env->roots = NULL;
+    env->root_count = 0;
+    env->root_capacity = 0;
+#ifdef YALP_GC_STRESS
+    env->stress_count = 0;
+#endif
+    env->frame_arena.chunk = NULL;
+    env->frame_arena.spare = NULL;
+    env->stack = NULL;
+    push_stack_frame(env, NULL, 64);
+    for (int c=0;c<SIZE_CLASSES;c++)
+        grow_heap(env, c, c == cons_class ? heap_config.initial_slots : 1);
+}
 
-    if (arg_count < 3)
-        return new_error(env, "loop needs at least 3 arguments");
+// Binds every builtin in the global frame, images bring their own instead
+static void add_builtins(struct env* env)
+{
+    for (size_t i=0;i<BUILTIN_COUNT;i++)
+        add_env_builtin_function(env, builtins[i].name, builtins[i].fn);
+}
 
-    struct sexpr* params = next(&args);
+static void free_env(struct env* env)
+{
+    while (env->stack)
+        pop_stack_frame(env);
+    free_arena(&env->frame_arena);
 
-    struct sexpr* initial_args = next(&args);
+    for (size_t i=0;i<env->external_object_count;i++)
+        free_external(env->external_objects[i]);
 
-    struct sexpr* body = args;
+    while (env->segments)
+    {
+        struct segment* next = env->segments->next;
+        free_segment(env->segments);
+        env->segments = next;
+    }
 
-    struct sexpr* l = new_function(env, lambda); 
+    for (size_t i=0;i<env->interned_capacity;i++)
+    {
+        if (env->interned[i])
+            free(cell_of(env->interned[i]));
+    }
+    free(env->interned);
+
+    free(env->nursery);
+    free(env->gray);
+    free(env->values);
+    free(env->external_objects);
+    free(env->remembered);
+    free(env->roots);
+}
 
-    l->function.lambda.params = params;
-    l->function.lambda.exprs = body;
+// Embedding API, see yalp.h
+struct yalp_isolate
+{
+    struct env env;
+};
 
-    return call_lambda(env, l, initial_args);
+struct yalp_isolate* yalp_isolate_create(void)
+{
+    struct yalp_isolate* isolate = malloc(sizeof(struct yalp_isolate));
+    set_env(&isolate->env, default_heap_config());
+    add_builtins(&isolate->env);
+    return isolate;
 }
 
-struct sexpr* eval_recur(struct env* env, struct sexpr* args)
+bool yalp_eval_string(struct yalp_isolate* isolate, const char* source, char** result)
 {
-    struct sexpr* lambda = env->stack->context;
+    struct input input;
+    init_string_input(&input, source);
+    struct sexpr* value = eval_input(&isolate->env, &input, true, NULL);
+    free_input(&input);
 
-    if (!lambda)
-        return new_error(env, "recur can only be used inside of lambda");
-
-    return call_lambda(env, lambda, args);
+    if (result)
+    {
+        size_t length;
+        FILE* out = open_memstream(result, &length);
+        if (value)
+            write_sexpr(out, value);
+        fclose(out);
+    }
+    return value && tag_of(value) != error;
 }
 
-struct sexpr* eval_progn(struct env* env, struct sexpr* args)
+void yalp_isolate_destroy(struct yalp_isolate* isolate)
 {
-    struct sexpr* result = NIL;
+    free_env(&isolate->env);
+    free(isolate);
+}
 
-    struct sexpr* arg;
-    while ((arg = next(&args)))
+// The command line interpreter, left out when yalp.c is linked into a host
+#ifndef YALP_NO_MAIN
+
+// Parses a heap size in bytes with an optional k/m/g suffix into a slot count
+static bool parse_heap_size(const char* str, size_t* slots)
+{
+    char* end;
+    double size = strtod(str, &end);
+    switch (*end)
     {
-        result = eval_sexpr(env, arg);
+        case 'k': case 'K': size *= 1024.0; end++; break;
+        case 'm': case 'M': size *= 1024.0 * 1024.0; end++; break;
+        case 'g': case 'G': size *= 1024.0 * 1024.0 * 1024.0; end++; break;
     }
 
-    return result;
+    if (end == str || *end != '\0' || size < SLOT_SIZE)
+        return false;
+
+    *slots = (size_t)(size / SLOT_SIZE);
+    return true;
 }
 
-struct sexpr* eval_sexpr(struct env* env, struct sexpr* sexpr)
+// Command line options besides the heap configuration
+struct options
 {
-    // Only lists are evaluated
-    if (sexpr->tag == list)
-    {
-        struct sexpr* value = eval_sexpr(env, sexpr->list.head);
+    // Index of the script to run, 0 when there is none. The arguments after
+    // it are the script's own.
+    int script;
+    bool read_only;
+    const char* image; // Image to start from, NULL to start empty
+    bool form_cache; // See eval_source
+    // Threads to run the script on with benchmark_isolates, 0 to just run it
+    int isolate_threads;
+};
 
-        if (value->tag == function)
-        {
-            struct sexpr* args = sexpr->list.tail;
-            switch (value->function.tag)
-            {
-                case builtin:
-                    return value->function.builtin.fn(env, args);
-                case lambda:
-                    return call_lambda(env, value, args);
-            }
-        }
-        else
-        {
-            return new_error(env, "Non function value found when evaluating list");
-        }
-    }
-    else if (sexpr->tag == symbol)
+// Prints how to run the interpreter to stderr
+static void print_usage(const char* program)
+{
+    fprintf(stderr,
+        "Usage: %s [--initial-heap SIZE] [--max-heap SIZE] [--heap-growth FACTOR] [--nursery SIZE]\n"
+        "          [--gc-pause-budget MICROSECONDS] [--compact] [--read-only] [--image IMAGE]\n"
+        "          [--no-cache] [--isolate-benchmark THREADS] [FILE [ARGS...]]\n"
+        "  Runs FILE with ARGS bound to args as a list of strings, or reads forms from stdin\n"
+        "  SIZE is in bytes with an optional k, m or g suffix, FACTOR must be above 1\n"
+        "  A pause budget makes full collections incremental\n"
+        "  --compact moves live objects together between top level forms after full collections\n"
+        "  --read-only reads the forms of FILE without running them and reports how fast it read\n"
+        "  --image starts from the global bindings saved to IMAGE with save_image\n"
+        "  Loaded files are cached as read in FILE.cache, --no-cache neither uses nor writes caches\n"
+        "  --isolate-benchmark runs FILE in up to THREADS isolates at once and reports the scaling\n"
+        "  --read-only and --isolate-benchmark need a FILE\n", program);
+}
+
+// The first argument that isn't an option is the script
+static bool parse_args(int argc, char** argv, struct heap_config* heap_config, struct options* options)
+{
+    options->script = 0;
+    options->read_only = false;
+    options->image = NULL;
+    options->form_cache = true;
+    options->isolate_threads = 0;
+    for (int i=1;i<argc;i++)
     {
-        struct sexpr* value = get_env_binding(env, sexpr->name);
-        if (!value)
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (arg[0] != '-')
         {
-            printf("Unknown symbol: %s\n", sexpr->name);
-            return new_error(env, "Unknown symbol");
+            options->script = i;
+            break;
         }
+        else if (strcmp(arg, "--initial-heap") == 0 && value && parse_heap_size(value, &heap_config->initial_slots))
+            i++;
+        else if (strcmp(arg, "--max-heap") == 0 && value && parse_heap_size(value, &heap_config->max_slots))
+            i++;
+        else if (strcmp(arg, "--nursery") == 0 && value && parse_heap_size(value, &heap_config->nursery_blocks))
+            i++;
+        else if (strcmp(arg, "--gc-pause-budget") == 0 && value && (heap_config->pause_budget_us = atol(value)) > 0)
+            i++;
+        else if (strcmp(arg, "--heap-growth") == 0 && value && (heap_config->growth_factor = strtod(value, NULL)) > 1.0)
+            i++;
+        else if (strcmp(arg, "--compact") == 0)
+            heap_config->compact = true;
+        else if (strcmp(arg, "--read-only") == 0)
+            options->read_only = true;
+        else if (strcmp(arg, "--image") == 0 && value)
+            options->image = argv[++i];
+        else if (strcmp(arg, "--no-cache") == 0)
+            options->form_cache = false;
+        else if (strcmp(arg, "--isolate-benchmark") == 0 && value && (options->isolate_threads = atoi(value)) > 0)
+            i++;
         else
         {
-            return value;
+            print_usage(argv[0]);
+            return false;
         }
     }
-    else
+
+    if (!options->script && (options->read_only || options->isolate_threads))
     {
-        return sexpr;
+        print_usage(argv[0]);
+        return false;
     }
+    return true;
 }
 
-void print_sexpr(struct sexpr* sexpr)
+// Runs a script without prompts or GC messages, errors go to stderr
+static int run_script(struct env* env, int argc, char** argv, int script)
 {
-    switch (sexpr->tag)
+    int fd = open(argv[script], O_RDONLY);
+    if (fd < 0)
     {
-    case error:
-        printf("Error: %s", sexpr->message);
-        break;
-    case nil:
-        printf("()");
-        break;
-    case integer:
-        printf("%d", sexpr->integer);
-        break;
-    case symbol:
-        printf("%s", sexpr->name);
-        break;
-    case boolean:
-        if (sexpr->boolean)
-            printf("true");
-        else
-            printf("false");
-        break;
-    case function:
-        switch (sexpr->function.tag)
-        {
-            case builtin:
-                printf("<builtin function '%s'>", sexpr->function.builtin.name);
-                break;
-            case lambda:
-                printf("<lambda function>");
-                break;
-        }
-        break;
-    case list:
-        printf("(");
-        while (sexpr != NIL)
-        {
-            print_sexpr(sexpr->list.head);
-
-            if ((sexpr = sexpr->list.tail) != NIL)
-                printf(" ");
-        }
-        printf(")");
-        break;
+        fprintf(stderr, "Can't read %s\n", argv[script]);
+        return 1;
     }
-}
 
-struct sexpr* eval_print(struct env* env, struct sexpr* args)
-{
-    struct sexpr* arg;
-    while ((arg = next(&args)))
+    size_t base = env->value_count;
+    reserve_values(env, argc - script);
+    for (int i=script + 1;i<argc;i++)
+        env->values[env->value_count++] = new_string(env, argv[i], strlen(argv[i]));
+    add_env_binding(env, intern(env, "args", 4), list_from_values(env, base, argc - script - 1));
+    env->value_count = base;
+
+    struct sexpr* result = eval_source(env, fd, argv[script], true);
+    close(fd);
+
+    if (!result || tag_of(result) == error)
     {
-        struct sexpr* value = eval_sexpr(env, arg);
-        CHECK_ERROR(value);
-        print_sexpr(value);
+        fflush(stdout);
+        fprintf(stderr, "Error: %s\n", error_message(result));
+        return 1;
     }
-
-    return NIL;
+    return 0;
 }
 
-struct sexpr* eval_printl(struct env* env, struct sexpr* args)
+// Measures the reader alone, the forms are dropped as they are read
+static int read_script(struct env* env, const char* path)
 {
-    eval_print(env, args);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Can't read %s\n", path);
+        return 1;
+    }
 
-    printf("\n");
+    struct input input;
+    init_fd_input(&input, fd);
+    struct reader reader;
+    init_reader(env, &reader);
 
-    return NIL;
-}
+    long long start = now_ns();
+    size_t forms = 0;
+    struct sexpr* form;
+    while ((form = next_form(env, &reader, &input)) && tag_of(form) != error)
+        forms++;
+    double seconds = (now_ns() - start) / 1e9;
+    double megabytes = input.bytes_read / (1024.0 * 1024.0);
 
-void set_env(struct env* env)
-{
-    memset(env->heap, 0, sizeof(env->heap));
-    env->stack = create_frame();
-    add_env_builtin_function(env, "+", eval_add);
-    add_env_builtin_function(env, "-", eval_subtract);
-    add_env_builtin_function(env, "*", eval_multiply);
-    add_env_builtin_function(env, "/", eval_division);
-    add_env_builtin_function(env, "=", eval_equals);
-    add_env_builtin_function(env, "<", eval_less);
-    add_env_builtin_function(env, "'", eval_quote);
-    add_env_builtin_function(env, "quote", eval_quote);
-    add_env_builtin_function(env, "list", eval_list);
-    add_env_builtin_function(env, "define", eval_define);
-    add_env_builtin_function(env, "if", eval_if);
-    add_env_builtin_function(env, "lambda", eval_lambda);
-    add_env_builtin_function(env, "defun", eval_defun);
-    add_env_builtin_function(env, "reduce", eval_reduce);
-    add_env_builtin_function(env, "print", eval_print);
-    add_env_builtin_function(env, "printl", eval_printl);
-    add_env_builtin_function(env, "recur", eval_recur);
-    add_env_builtin_function(env, "loop", eval_loop);
-    add_env_builtin_function(env, "progn", eval_progn);
-}
-
-void readline(char* buff, size_t size, bool* eof)
-{
-    memset(buff, '\0', size);
-    for(size_t i=0;i<size-1;)
-    {
-        int data = getchar();
-        if (data == EOF)
-        {
-            if (eof)
-                *eof = true;
-            return;
-        }
-        if (data == '\r')
-            continue;
-        if (data == '\n')
-            return;
-        buff[i++] = data;
-    }
-}
+    free_reader(env, &reader);
+    free_input(&input);
+    close(fd);
 
-int paren_balance(const char* str)
-{
-    int balance = 0;
-    char c;
-    while((c = *(str++)) != '\0')
+    if (form)
     {
-        if (c == '(')
-            balance++;
-        else if (c == ')')
-            balance--;
+        fprintf(stderr, "Error: %s\n", error_message(form));
+        return 1;
     }
-
-    return balance;
+    printf("Read %zu forms, %.1f MB in %.3f s (%.1f MB/s)\n", forms, megabytes, seconds, megabytes / seconds);
+    return 0;
 }
 
-struct string_builder
+struct isolate_run
 {
-    char* str;
-    size_t total_bytes;
+    pthread_t thread;
+    const char* source;
+    bool ran;
 };
 
-void init_string_builder(struct string_builder *builder)
+static void* run_isolate(void* argument)
 {
-    static const size_t DEFAULT_SIZE = 64;
-    builder->str = (char*) malloc(DEFAULT_SIZE);
-    builder->total_bytes = DEFAULT_SIZE;
-    builder->str[0] = '\0';
+    struct isolate_run* run = argument;
+    struct yalp_isolate* isolate = yalp_isolate_create();
+    run->ran = yalp_eval_string(isolate, run->source, NULL);
+    yalp_isolate_destroy(isolate);
+    return NULL;
 }
 
-void append_string_builder(struct string_builder* builder, const char* str)
+// Runs a script in 1, 2, 4 and so on up to max_threads isolates at once,
+// each on its own thread, and reports how the throughput scales
+static int benchmark_isolates(const char* path, int max_threads)
 {
-    size_t current_length = strlen(builder->str);
-    size_t new_length = current_length + strlen(str) + 1;
-    if (new_length > builder->total_bytes)
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    char* source = NULL;
+    if (fd >= 0 && fstat(fd, &info) == 0)
+    {
+        source = malloc(info.st_size + 1);
+        if (read(fd, source, info.st_size) == info.st_size)
+            source[info.st_size] = '\0';
+        else
+        {
+            free(source);
+            source = NULL;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    if (!source)
     {
-        builder->total_bytes *= 2;
-        builder->str = realloc(builder->str, builder->total_bytes);
+        fprintf(stderr, "Can't read %s\n", path);
+        return 1;
     }
 
-    strncat(builder->str, str, new_length - current_length);
-}
+    struct isolate_run* runs = malloc(sizeof(struct isolate_run) * max_threads);
+    double single_rate = 0;
+    int status = 0;
+    // A first run that isn't timed, so the allocator and the caches are warm
+    runs[0].source = source;
+    run_isolate(&runs[0]);
+    printf("Threads   Seconds     Runs/s   Speedup   Efficiency\n");
+    for (int threads=1;;threads = threads * 2 < max_threads ? threads * 2 : max_threads)
+    {
+        long long start = now_ns();
+        for (int i=0;i<threads;i++)
+        {
+            runs[i].source = source;
+            runs[i].ran = false;
+            pthread_create(&runs[i].thread, NULL, run_isolate, &runs[i]);
+        }
+        for (int i=0;i<threads;i++)
+        {
+            pthread_join(runs[i].thread, NULL);
+            if (!runs[i].ran)
+                status = 1;
+        }
+        double seconds = (now_ns() - start) / 1e9;
+
+        double rate = threads / seconds;
+        if (threads == 1)
+            single_rate = rate;
+        double speedup = rate / single_rate;
+        printf("%7d %9.3f %10.2f %8.2fx %11.0f%%\n", threads, seconds, rate, speedup, 100 * speedup / threads);
+        fflush(stdout);
+        if (threads == max_threads)
+            break;
+    }
 
-void reset_string_builder(struct string_builder* builder)
-{
-    builder->str[0] = '\0';
+    free(runs);
+    free(source);
+    if (status)
+        fprintf(stderr, "Error: %s didn't run to the end in every isolate\n", path);
+    return status;
 }
 
-void free_string_builder(struct string_builder* builder)
+int main(int argc, char** argv)
 {
-    free(builder->str);
-}
+    struct heap_config heap_config = default_heap_config();
+    struct options options;
+    if (!parse_args(argc, argv, &heap_config, &options))
+        return 1;
 
+    if (options.isolate_threads && options.script)
+        return benchmark_isolates(argv[options.script], options.isolate_threads);
 
-int main()
-{
     struct env env;
-    set_env(&env);
+    set_env(&env, heap_config);
+    env.form_cache = options.form_cache;
+    if (!options.image)
+        add_builtins(&env);
+    else if (!load_image(&env, options.image))
+    {
+        free_env(&env);
+        return 1;
+    }
 
-    struct string_builder input_builder;
-    init_string_builder(&input_builder);
+    if (options.script)
+    {
+        int status = options.read_only ? read_script(&env, argv[options.script]) : run_script(&env, argc, argv, options.script);
+        free_env(&env);
+        return status;
+    }
 
-    bool eof = false;
+    struct input input;
+    init_fd_input(&input, STDIN_FILENO);
+    struct reader reader;
+    init_reader(&env, &reader);
 
-    while (!eof)
+    while (true)
     {
-        static char buffer[4096];
         printf("> ");
 
-        reset_string_builder(&input_builder);
-        do
-        {
-            readline(buffer, 4096, &eof);
-            const char* line = buffer;
-
-            skip_whitespace(&line);
-
-            append_string_builder(&input_builder, line);
-            append_string_builder(&input_builder, "\n");
-        } while(!eof && paren_balance(input_builder.str) > 0);
-
-        const char* input = input_builder.str;
-
-        if (input[0] == '\0')
-            continue;
-
-        struct sexpr* e = read_sexpr(&env, &input);
-
-        skip_whitespace(&input);
-
-        if (input[0] != '\0')
+        struct sexpr* e = next_form(&env, &reader, &input);
+        if (!e)
         {
-            printf("Error: unparsed content in string: %s\n", input);
-            continue;
+            printf("\n");
+            break;
         }
 
-        if (!e || e->tag == error)
+        if (tag_of(e) == error)
         {
-            printf("Error: %s\n", e->message);
+            printf("Error: %s\n", error_message(e));
             continue;
         }
 
-        e = eval_sexpr(&env, e);
+        e = eval_toplevel(&env, e);
         printf("< "); print_sexpr(e); printf("\n");
 
-        collect_garbage(&env);
+        size_t collected = collect_young(&env);
+        // Nothing but the frames refers to the heap here, so objects can move
+        compact_heap_if_fragmented(&env);
+        printf("GC collected %ld objects, heap now has %ld slots available (%ld total)\n",
+            (long)collected, (long)available_heap_space(&env), (long)heap_slots(&env));
     }
 
-    free_string_builder(&input_builder);
+    free_reader(&env, &reader);
+    free_input(&input);
+    free_env(&env);
 
     return 0;
-}
\ No newline at end of file
+}
+
+#endif
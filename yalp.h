@@ -0,0 +1,30 @@
+// Embedding API. Build yalp.c with YALP_NO_MAIN defined to leave out the
+// command line interpreter and link it into the host program.
+#ifndef YALP_H
+#define YALP_H
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// An interpreter with its own heap, stack, names and globals. Isolates share
+// no mutable state, so a host can run one per thread, but an isolate must
+// only be used by one thread at a time.
+struct yalp_isolate;
+
+struct yalp_isolate* yalp_isolate_create(void);
+
+// Runs every form of source, stopping at the first error, and returns
+// whether they all ran. Unless result is NULL it gets the printed value of
+// the last form, or the error, in a string the caller frees.
+bool yalp_eval_string(struct yalp_isolate* isolate, const char* source, char** result);
+
+void yalp_isolate_destroy(struct yalp_isolate* isolate);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif